@@ -0,0 +1,110 @@
+"""Memory regression benchmark for async result delivery.
+
+Runs millions of async operations through one client, collecting results
+with async_wait, async_poll and completion callbacks, and checks that the
+process does not grow once warmed up: the number of gc-tracked objects,
+the total reference count (on debug builds of python) and the resident
+set size are compared between the first and the last round.
+
+    python bench/async_memory.py --host localhost --rounds 10 --ops 200000
+
+Exits with status 1 if anything grew beyond the tolerances."""
+
+import gc
+import os
+import sys
+import time
+from optparse import OptionParser
+
+from couchbase import Client
+
+
+def rss_kb():
+    try:
+        with open('/proc/self/statm') as f:
+            return int(f.read().split()[1]) * os.sysconf('SC_PAGE_SIZE') / 1024
+    except IOError:
+        import resource
+        return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+
+def snapshot():
+    gc.collect()
+    refs = getattr(sys, 'gettotalrefcount', lambda: 0)()
+    return len(gc.get_objects()), refs, rss_kb()
+
+
+def run_round(client, ops, window):
+    done = [0]
+
+    def callback(ticket, result):
+        done[0] += 1
+
+    n = 0
+    while n < ops:
+        batch = min(window, ops - n)
+        mode = (n / window) % 3
+        for i in xrange(batch):
+            key = 'bench:%d' % (i % 64)
+            if mode == 2:
+                client.get(key, callback=callback)
+            elif i % 4:
+                client.get(key)
+            else:
+                client.set(key, i)
+        if mode == 0:
+            client.async_wait()
+        else:
+            while client.get_async_count():
+                client.async_poll(window / 4)
+            client.async_poll()
+        n += batch
+    return n
+
+
+def main():
+    parser = OptionParser()
+    parser.add_option('--host', default='localhost')
+    parser.add_option('--bucket', default='default')
+    parser.add_option('--rounds', type='int', default=10)
+    parser.add_option('--ops', type='int', default=200000,
+                      help='operations per round')
+    parser.add_option('--window', type='int', default=1000,
+                      help='async limit and batch size')
+    parser.add_option('--max-objects', type='int', default=100,
+                      help='allowed growth in gc-tracked objects')
+    parser.add_option('--max-rss', type='int', default=1024,
+                      help='allowed RSS growth in kB')
+    options, args = parser.parse_args()
+
+    client = Client(options.host, bucket=options.bucket)
+    client.set_async_limit(options.window)
+    client.enable_async()
+
+    # warm up caches, free lists and the result buffer
+    run_round(client, options.ops, options.window)
+    first = snapshot()
+    print '%5s %10s %10s %10s %12s %10s' % ('round', 'ops/s', 'objects',
+                                           'refs', 'rss kB', 'in use')
+
+    for r in xrange(options.rounds):
+        start = time.time()
+        n = run_round(client, options.ops, options.window)
+        elapsed = time.time() - start
+        objects, refs, rss = snapshot()
+        print '%5d %10d %10d %10d %12d %10d' % (
+            r, n / elapsed, objects, refs, rss, client.stats()['arena']['in_use'])
+
+    last = snapshot()
+    growth = [last[0] - first[0], last[1] - first[1], last[2] - first[2]]
+    print 'growth: %d objects, %d refs, %d kB' % tuple(growth)
+
+    if growth[0] > options.max_objects or growth[1] > options.max_objects \
+            or growth[2] > options.max_rss:
+        print 'FAIL'
+        sys.exit(1)
+    print 'OK'
+
+
+if __name__ == '__main__':
+    main()
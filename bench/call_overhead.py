@@ -0,0 +1,115 @@
+"""Per-call overhead of the client API, in nanoseconds.
+
+Every call is a get served from the near cache, so no request leaves the
+process and the time measured is argument parsing, instance lookup and
+value delivery. Compared paths:
+
+  native     Client.get, a method of the native Connection type
+  module     _pylibcb.get on a PyCObject instance, positional arguments
+  wrapper    a python method doing the timeout arithmetic around
+             _pylibcb.get, as Client.get used to
+  roundtrip  Client.get with the near cache disabled, for scale
+
+An empty loop is timed first and subtracted from the others.
+
+    python bench/call_overhead.py --calls 1000000 --size 1024"""
+
+import sys
+import time
+from optparse import OptionParser
+
+import _pylibcb
+from couchbase import Client
+
+from suite import start_mock
+
+
+class Wrapper(object):
+
+    def __init__(self, instance, timeout=0):
+        self.instance = instance
+        self.timeout = int(timeout * 1000)
+
+    def get(self, key, timeout=0, callback=None):
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.get(self.instance, key, timeout, 0, 0, callback)
+
+
+def timed(calls, step):
+    start = time.time()
+    step(calls)
+    return (time.time() - start) * 1e9 / calls
+
+
+def main():
+    parser = OptionParser()
+    parser.add_option('--host', default=None,
+                      help='use a running server instead of the mock')
+    parser.add_option('--calls', type='int', default=1000000)
+    parser.add_option('--size', type='int', default=1024,
+                      help='value size in bytes')
+    parser.add_option('--roundtrips', type='int', default=10000,
+                      help='calls for the uncached scenario')
+    parser.add_option('--latency-ms', type='float', default=0.0)
+    parser.add_option('--error-rate', type='float', default=0.0)
+    options, args = parser.parse_args()
+
+    mock = None
+    host = options.host
+    if not host:
+        mock, host = start_mock(options)
+
+    try:
+        key, value = 'bench:overhead', 'x' * options.size
+        client = Client(host)
+        client.set(key, value)
+
+        instance = _pylibcb.open(host, '', '', 'default')
+        _pylibcb.set_transcoding(instance, 1)
+        _pylibcb.set(instance, key, value)
+        wrapper = Wrapper(instance)
+
+        # entries stay fresh for the whole run
+        ttl = 3600 * 1000
+        client.enable_near_cache(ttl=ttl)
+        _pylibcb.enable_near_cache(instance, 16, 1 << 20, ttl * 1000)
+        client.get(key)
+        wrapper.get(key)
+
+        def empty(n):
+            for i in xrange(n):
+                pass
+
+        def native(n):
+            get = client.get
+            for i in xrange(n):
+                get(key)
+
+        def module(n):
+            get = _pylibcb.get
+            for i in xrange(n):
+                get(instance, key, 0, 0, 0, None)
+
+        def wrapped(n):
+            get = wrapper.get
+            for i in xrange(n):
+                get(key)
+
+        base = timed(options.calls, empty)
+        print '%-10s %10s' % ('path', 'ns/call')
+        for name, step in (('native', native), ('module', module),
+                           ('wrapper', wrapped)):
+            print '%-10s %10.0f' % (name, timed(options.calls, step) - base)
+            sys.stdout.flush()
+
+        client.disable_near_cache()
+        print '%-10s %10.0f' % ('roundtrip',
+                                timed(options.roundtrips, native) - base)
+    finally:
+        if mock:
+            mock.kill()
+            mock.wait()
+
+
+if __name__ == '__main__':
+    main()
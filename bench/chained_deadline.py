@@ -0,0 +1,93 @@
+"""Deadline check for async_wait and async_poll with chained requests.
+
+Every completion callback queues another get, so the client never runs
+out of work on its own. async_wait and async_poll with a timeout must
+still return once their deadline passes. The mock adds latency so the
+chain outlives the deadline:
+
+    python bench/chained_deadline.py --timeout-ms 50 --latency-ms 5
+
+Exits with status 1 if a wait overran its deadline by more than the
+allowed slack."""
+
+import sys
+import time
+from optparse import OptionParser
+
+from couchbase import Client
+
+from suite import start_mock
+
+
+def chained(client, key, rounds):
+    left = [rounds]
+
+    def callback(ticket, result):
+        if left[0]:
+            left[0] -= 1
+            client.get(key, callback=callback)
+
+    client.get(key, callback=callback)
+    return left
+
+
+def timed(step):
+    start = time.time()
+    step()
+    return (time.time() - start) * 1000
+
+
+def main():
+    parser = OptionParser()
+    parser.add_option('--host', default=None,
+                      help='use a running server instead of the mock')
+    parser.add_option('--timeout-ms', type='float', default=50.0)
+    parser.add_option('--slack-ms', type='float', default=50.0,
+                      help='allowed overrun of the deadline')
+    parser.add_option('--chain', type='int', default=100000,
+                      help='gets each chain may queue')
+    parser.add_option('--latency-ms', type='float', default=5.0)
+    parser.add_option('--error-rate', type='float', default=0.0)
+    options, args = parser.parse_args()
+
+    mock = None
+    host = options.host
+    if not host:
+        mock, host = start_mock(options)
+
+    failed = False
+    try:
+        key = 'bench:chained'
+        client = Client(host)
+        client.set(key, 'x')
+        client.enable_async()
+
+        for name, wait in (('async_wait', client.async_wait),
+                           ('async_poll', client.async_poll)):
+            left = chained(client, key, options.chain)
+            if name == 'async_wait':
+                elapsed = timed(lambda: wait(options.timeout_ms))
+            else:
+                elapsed = timed(lambda: wait(0, options.timeout_ms))
+            ok = elapsed <= options.timeout_ms + options.slack_ms
+            failed = failed or not ok
+            print '%-12s %8.1f ms (deadline %.1f ms, %d gets chained) %s' % (
+                name, elapsed, options.timeout_ms, options.chain - left[0],
+                ok and 'OK' or 'FAIL')
+            sys.stdout.flush()
+
+            # stop the chain and drain it before the next scenario
+            left[0] = 0
+            while client.get_async_count():
+                client.async_poll()
+    finally:
+        if mock:
+            mock.kill()
+            mock.wait()
+
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
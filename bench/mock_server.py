@@ -0,0 +1,473 @@
+"""Local stand-in for a single node Couchbase bucket.
+
+Serves the streaming bucket configuration that libcouchbase_connect reads
+from the REST port and the memcached binary protocol on the data port,
+keeping items in memory. Responses can be delayed and a fraction of the
+requests can be failed with a given status, so latency and error handling
+can be measured without a cluster:
+
+    python bench/mock_server.py --port 8091 --latency-ms 0.5 --error-rate 0.01
+
+Connect a client to 127.0.0.1:<port>. The listening ports are printed on
+the first line of output ("listening rest=<port> data=<port>") so the
+benchmark suite can start the server on ephemeral ports."""
+
+import errno
+import heapq
+import json
+import random
+import select
+import socket
+import struct
+import sys
+import time
+from optparse import OptionParser
+
+HEADER = struct.Struct('>BBHBBHIIQ')
+REQ_MAGIC = 0x80
+RES_MAGIC = 0x81
+
+SUCCESS = 0x00
+KEY_ENOENT = 0x01
+KEY_EEXISTS = 0x02
+E2BIG = 0x03
+EINVAL = 0x04
+NOT_STORED = 0x05
+DELTA_BADVAL = 0x06
+NOT_MY_VBUCKET = 0x07
+UNKNOWN_COMMAND = 0x81
+ENOMEM = 0x82
+ETMPFAIL = 0x86
+
+GET, SET, ADD, REPLACE, DELETE, INCREMENT, DECREMENT, QUIT, FLUSH, \
+    GETQ, NOOP, VERSION, GETK, GETKQ, APPEND, PREPEND, STAT = range(0x11)
+TOUCH = 0x1c
+GAT = 0x1d
+GATQ = 0x1e
+SASL_LIST_MECHS = 0x20
+SASL_AUTH = 0x21
+SASL_STEP = 0x22
+
+# quiet variants of the storage commands, answered only on failure
+QUIET = {0x11: SET, 0x12: ADD, 0x13: REPLACE, 0x14: DELETE,
+         0x15: INCREMENT, 0x16: DECREMENT, 0x17: QUIT, 0x18: FLUSH,
+         0x19: APPEND, 0x1a: PREPEND, GETQ: GET, GETKQ: GETK, GATQ: GAT}
+
+# requests that are never failed by error injection
+CONTROL = (NOOP, VERSION, STAT, QUIT, SASL_LIST_MECHS, SASL_AUTH, SASL_STEP)
+
+MAX_VALUE = 20 * 1024 * 1024
+RELATIVE_EXPIRY = 30 * 24 * 3600
+
+
+class Item(object):
+
+    __slots__ = ('value', 'flags', 'cas', 'expiry')
+
+    def __init__(self, value, flags, cas, expiry):
+        self.value = value
+        self.flags = flags
+        self.cas = cas
+        self.expiry = expiry
+
+
+class Connection(object):
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.inbuf = ''
+        self.outbuf = []
+        self.closing = False
+
+    def fileno(self):
+        return self.sock.fileno()
+
+    def wants_write(self):
+        return bool(self.outbuf)
+
+    def write(self, data):
+        self.outbuf.append(data)
+
+    def flush(self):
+        data = ''.join(self.outbuf)
+        try:
+            sent = self.sock.send(data)
+        except socket.error, e:
+            if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK):
+                sent = 0
+            else:
+                raise
+        self.outbuf = [data[sent:]] if sent < len(data) else []
+
+
+class RestConnection(Connection):
+
+    """Answers the bucketsStreaming request and keeps the stream open"""
+
+    def __init__(self, sock, server):
+        Connection.__init__(self, sock)
+        self.server = server
+
+    def received(self, data):
+        self.inbuf += data
+        if '\r\n\r\n' not in self.inbuf:
+            return
+        request, self.inbuf = self.inbuf.split('\r\n\r\n', 1)
+        path = request.split('\r\n', 1)[0].split(' ')[1]
+
+        if path.rstrip('/') == '/pools/default/bucketsStreaming/' + \
+                self.server.bucket:
+            config = json.dumps(self.server.config()) + '\n\n\n\n'
+            self.write('HTTP/1.1 200 OK\r\n'
+                       'Content-Type: application/json; charset=utf-8\r\n'
+                       'Transfer-Encoding: chunked\r\n\r\n'
+                       '%x\r\n%s\r\n' % (len(config), config))
+        else:
+            self.write('HTTP/1.1 404 Object Not Found\r\n'
+                       'Content-Length: 0\r\n\r\n')
+            self.closing = True
+
+
+class DataConnection(Connection):
+
+    """Parses memcached binary requests and queues their responses"""
+
+    def __init__(self, sock, server):
+        Connection.__init__(self, sock)
+        self.server = server
+        self.last_due = 0
+
+    def received(self, data):
+        self.inbuf += data
+        while len(self.inbuf) >= HEADER.size:
+            magic, opcode, nkey, nextras, datatype, vbucket, nbody, \
+                opaque, cas = HEADER.unpack_from(self.inbuf)
+            if magic != REQ_MAGIC:
+                self.closing = True
+                return
+            if len(self.inbuf) < HEADER.size + nbody:
+                return
+
+            body = self.inbuf[HEADER.size:HEADER.size + nbody]
+            self.inbuf = self.inbuf[HEADER.size + nbody:]
+            extras = body[:nextras]
+            key = body[nextras:nextras + nkey]
+            value = body[nextras + nkey:]
+
+            response = self.server.execute(opcode, key, extras, value, cas,
+                                           opaque)
+            if response is not None:
+                self.respond(response)
+
+    def respond(self, response):
+        due = self.server.due()
+        if due is None:
+            self.write(response)
+            return
+
+        # keep responses in request order on each connection
+        due = max(due, self.last_due)
+        self.last_due = due
+        self.server.delay(due, self, response)
+
+
+def response(opcode, status, opaque, cas=0, extras='', key='', value=''):
+    return HEADER.pack(RES_MAGIC, opcode, len(key), len(extras), 0, status,
+                       len(extras) + len(key) + len(value), opaque,
+                       cas) + extras + key + value
+
+
+class MockServer(object):
+
+    def __init__(self, host='127.0.0.1', port=0, data_port=0,
+                 bucket='default', vbuckets=64, latency=0.0, jitter=0.0,
+                 error_rate=0.0, error_status=ETMPFAIL, seed=None):
+        """Listen on the REST and data ports.
+
+        :param host: address to listen on
+        :param port: REST port, an ephemeral port if 0
+        :param data_port: memcached port, an ephemeral port if 0
+        :param bucket: bucket name served
+        :param vbuckets: number of vbuckets in the configuration
+        :param latency: seconds every response is delayed by
+        :param jitter: maximum random seconds added to the latency
+        :param error_rate: fraction of requests failed with error_status
+        :param error_status: memcached status code for injected failures
+        :param seed: random seed for jitter and error injection"""
+        self.host = host
+        self.bucket = bucket
+        self.vbuckets = vbuckets
+        self.latency = latency
+        self.jitter = jitter
+        self.error_rate = error_rate
+        self.error_status = error_status
+        self.random = random.Random(seed)
+
+        self.items = {}
+        self.cas = 0
+        self.delayed = []
+        self.sequence = 0
+        self.counters = dict.fromkeys(('requests', 'errors_injected'), 0)
+
+        self.rest = self.listen(port)
+        self.data = self.listen(data_port)
+        self.port = self.rest.getsockname()[1]
+        self.data_port = self.data.getsockname()[1]
+        self.connections = []
+
+    def listen(self, port):
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        s.bind((self.host, port))
+        s.listen(128)
+        s.setblocking(0)
+        return s
+
+    def config(self):
+        server = '%s:%d' % (self.host, self.data_port)
+        return {
+            'name': self.bucket,
+            'bucketType': 'membase',
+            'authType': 'sasl',
+            'saslPassword': '',
+            'nodeLocator': 'vbucket',
+            'nodes': [{'hostname': '%s:%d' % (self.host, self.port),
+                       'status': 'healthy',
+                       'ports': {'direct': self.data_port, 'proxy': 0}}],
+            'vBucketServerMap': {'hashAlgorithm': 'CRC',
+                                 'numReplicas': 0,
+                                 'serverList': [server],
+                                 'vBucketMap': [[0]] * self.vbuckets},
+        }
+
+    def due(self):
+        if not self.latency and not self.jitter:
+            return None
+        return time.time() + self.latency + self.random.random() * self.jitter
+
+    def delay(self, due, connection, data):
+        self.sequence += 1
+        heapq.heappush(self.delayed, (due, self.sequence, connection, data))
+
+    def next_cas(self):
+        self.cas += 1
+        return self.cas
+
+    def lookup(self, key):
+        item = self.items.get(key)
+        if item and item.expiry and item.expiry <= time.time():
+            del self.items[key]
+            return None
+        return item
+
+    def expiry(self, exp):
+        if not exp:
+            return 0
+        if exp <= RELATIVE_EXPIRY:
+            return time.time() + exp
+        return exp
+
+    def execute(self, opcode, key, extras, value, cas, opaque):
+        self.counters['requests'] += 1
+        quiet = opcode in QUIET
+        op = QUIET.get(opcode, opcode)
+
+        def reply(status, **kwargs):
+            if quiet and (status == SUCCESS or
+                          (status == KEY_ENOENT and op in (GET, GETK, GAT))):
+                return None
+            return response(opcode, status, opaque, **kwargs)
+
+        if op not in CONTROL and self.error_rate and \
+                self.random.random() < self.error_rate:
+            self.counters['errors_injected'] += 1
+            return response(opcode, self.error_status, opaque)
+
+        if op in (GET, GETK, GAT, TOUCH):
+            item = self.lookup(key)
+            if not item:
+                return reply(KEY_ENOENT)
+            if op in (GAT, TOUCH):
+                item.expiry = self.expiry(struct.unpack('>I', extras)[0])
+            if op == TOUCH:
+                return reply(SUCCESS, cas=item.cas)
+            return reply(SUCCESS, cas=item.cas,
+                         extras=struct.pack('>I', item.flags),
+                         key=key if op == GETK else '', value=item.value)
+
+        if op in (SET, ADD, REPLACE, APPEND, PREPEND):
+            item = self.lookup(key)
+            if len(value) > MAX_VALUE:
+                return reply(E2BIG)
+            if op == ADD and item:
+                return reply(KEY_EEXISTS)
+            if op in (REPLACE, APPEND, PREPEND) and not item:
+                return reply(NOT_STORED)
+            if cas and (not item or item.cas != cas):
+                return reply(KEY_EEXISTS if item else KEY_ENOENT)
+
+            if op == APPEND:
+                item.value += value
+            elif op == PREPEND:
+                item.value = value + item.value
+            else:
+                flags, exp = struct.unpack('>II', extras)
+                item = Item(value, flags, 0, self.expiry(exp))
+                self.items[key] = item
+            item.cas = self.next_cas()
+            return reply(SUCCESS, cas=item.cas)
+
+        if op == DELETE:
+            item = self.lookup(key)
+            if not item:
+                return reply(KEY_ENOENT)
+            if cas and item.cas != cas:
+                return reply(KEY_EEXISTS)
+            del self.items[key]
+            return reply(SUCCESS)
+
+        if op in (INCREMENT, DECREMENT):
+            delta, initial, exp = struct.unpack('>QQI', extras)
+            item = self.lookup(key)
+            if not item:
+                if exp == 0xffffffff:
+                    return reply(KEY_ENOENT)
+                item = Item(str(initial), 0, 0, self.expiry(exp))
+                self.items[key] = item
+            else:
+                if cas and item.cas != cas:
+                    return reply(KEY_EEXISTS)
+                try:
+                    current = int(item.value)
+                except ValueError:
+                    return reply(DELTA_BADVAL)
+                if op == INCREMENT:
+                    current = (current + delta) & 0xffffffffffffffff
+                else:
+                    current = max(current - delta, 0)
+                item.value = str(current)
+            item.cas = self.next_cas()
+            return reply(SUCCESS, cas=item.cas,
+                         value=struct.pack('>Q', int(item.value)))
+
+        if op == FLUSH:
+            self.items.clear()
+            return reply(SUCCESS)
+        if op == NOOP:
+            return reply(SUCCESS)
+        if op == VERSION:
+            return reply(SUCCESS, value='1.4.4_mock')
+        if op == STAT:
+            return reply(SUCCESS)
+        if op == QUIT:
+            return reply(SUCCESS)
+        if op == SASL_LIST_MECHS:
+            return reply(SUCCESS, value='PLAIN')
+        if op in (SASL_AUTH, SASL_STEP):
+            return reply(SUCCESS, value='Authenticated')
+        return reply(UNKNOWN_COMMAND)
+
+    def accept(self, listener, cls):
+        try:
+            sock, address = listener.accept()
+        except socket.error:
+            return
+        sock.setblocking(0)
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.connections.append(cls(sock, self))
+
+    def close(self, connection):
+        connection.sock.close()
+        self.connections.remove(connection)
+        self.delayed = [d for d in self.delayed if d[2] is not connection]
+        heapq.heapify(self.delayed)
+
+    def release_delayed(self):
+        now = time.time()
+        while self.delayed and self.delayed[0][0] <= now:
+            due, sequence, connection, data = heapq.heappop(self.delayed)
+            connection.write(data)
+
+    def serve_once(self, timeout=None):
+        self.release_delayed()
+        if self.delayed:
+            wait = max(self.delayed[0][0] - time.time(), 0)
+            timeout = wait if timeout is None else min(timeout, wait)
+
+        readers = [self.rest, self.data] + self.connections
+        writers = [c for c in self.connections if c.wants_write()]
+        try:
+            readable, writable, _ = select.select(readers, writers, [],
+                                                  timeout)
+        except select.error, e:
+            if e.args[0] == errno.EINTR:
+                return
+            raise
+
+        for r in readable:
+            if r is self.rest:
+                self.accept(r, RestConnection)
+            elif r is self.data:
+                self.accept(r, DataConnection)
+            else:
+                try:
+                    data = r.sock.recv(65536)
+                except socket.error:
+                    data = ''
+                if not data:
+                    self.close(r)
+                    continue
+                r.received(data)
+                if r.closing and not r.wants_write():
+                    self.close(r)
+
+        for w in writable:
+            if w in self.connections:
+                try:
+                    w.flush()
+                except socket.error:
+                    self.close(w)
+                    continue
+                if w.closing and not w.wants_write():
+                    self.close(w)
+
+    def serve_forever(self):
+        while True:
+            self.serve_once()
+
+
+def main():
+    parser = OptionParser()
+    parser.add_option('--host', default='127.0.0.1')
+    parser.add_option('--port', type='int', default=0,
+                      help='REST port (ephemeral if 0)')
+    parser.add_option('--data-port', type='int', default=0,
+                      help='memcached port (ephemeral if 0)')
+    parser.add_option('--bucket', default='default')
+    parser.add_option('--latency-ms', type='float', default=0.0,
+                      help='delay added to every response')
+    parser.add_option('--jitter-ms', type='float', default=0.0,
+                      help='maximum random delay added to the latency')
+    parser.add_option('--error-rate', type='float', default=0.0,
+                      help='fraction of requests failed')
+    parser.add_option('--error-status', type='int', default=ETMPFAIL,
+                      help='memcached status of failed requests')
+    parser.add_option('--seed', type='int', default=None)
+    options, args = parser.parse_args()
+
+    server = MockServer(options.host, options.port, options.data_port,
+                        options.bucket, latency=options.latency_ms / 1000,
+                        jitter=options.jitter_ms / 1000,
+                        error_rate=options.error_rate,
+                        error_status=options.error_status, seed=options.seed)
+    print 'listening rest=%d data=%d' % (server.port, server.data_port)
+    sys.stdout.flush()
+
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,244 @@
+"""End-to-end benchmark suite for the extension.
+
+Starts bench/mock_server.py on ephemeral ports (or uses --host) and runs
+each scenario for a fixed time through a Client:
+
+  sync get, set and remove for every value size
+  async get pipelines at several set_async_limit values
+  async get pipelines of a single hot key, with coalescing on and off
+  sync get at several miss ratios
+
+Throughput is measured around the calls, latency percentiles come from
+the extension's own histograms (Client.stats). Results can be written as
+JSON and compared against a run from another commit:
+
+    python bench/suite.py --json before.json
+    python bench/suite.py --compare before.json
+
+The mock serves from a single python process, so absolute numbers are
+bounded by it; compare runs made on the same box with the same options."""
+
+import json
+import os
+import random
+import re
+import subprocess
+import sys
+import time
+from optparse import OptionParser
+
+from couchbase import Client
+
+KEYS = 256
+
+
+def parse_list(value, cast):
+    return [cast(v) for v in value.split(',') if v]
+
+
+class Suite(object):
+
+    def __init__(self, client, seconds, only=None):
+        self.client = client
+        self.seconds = seconds
+        self.only = only and re.compile(only)
+        self.results = []
+
+    def run(self, name, op, step):
+        """Call step(i) until the time is up, step returns the number of
+        operations it completed"""
+        if self.only and not self.only.search(name):
+            return None
+
+        self.client.stats(reset=True)
+        n = i = 0
+        start = time.time()
+        deadline = start + self.seconds
+        while True:
+            n += step(i)
+            i += 1
+            if not i % 16 and time.time() >= deadline:
+                break
+        elapsed = time.time() - start
+
+        latency = self.client.stats(percentiles=(50, 99, 99.9),
+                                    reset=True)['latency'][op]
+        result = {'name': name, 'ops': n, 'ops_per_sec': n / elapsed,
+                  'p50': latency['p50'], 'p99': latency['p99'],
+                  'p99.9': latency['p99.9']}
+        self.results.append(result)
+        return result
+
+    def preload(self, size):
+        value = 'x' * size
+        keys = ['bench:%d:%d' % (size, i) for i in xrange(KEYS)]
+        for key in keys:
+            self.client.set(key, value)
+        return keys, value
+
+    def sizes(self, sizes):
+        client = self.client
+        for size in sizes:
+            keys, value = self.preload(size)
+
+            def get(i):
+                client.get(keys[i % KEYS])
+                return 1
+            yield self.run('get %dB' % size, 'get', get)
+
+            def set(i):
+                client.set(keys[i % KEYS], value)
+                return 1
+            yield self.run('set %dB' % size, 'set', set)
+
+            def remove(i):
+                key = 'bench:remove:%d' % i
+                client.set(key, value)
+                client.remove(key)
+                return 1
+            yield self.run('remove %dB' % size, 'remove', remove)
+
+    def pipelines(self, limits, size):
+        client = self.client
+        keys, value = self.preload(size)
+
+        for limit in limits:
+            client.set_async_limit(limit)
+            client.enable_async()
+
+            def window(i):
+                for j in xrange(limit):
+                    client.get(keys[(i * limit + j) % KEYS])
+                return len(client.async_wait())
+            try:
+                yield self.run('async get limit=%d' % limit, 'get', window)
+            finally:
+                client.disable_async()
+
+    def hot_key(self, limits, size):
+        client = self.client
+        key, value = 'bench:hot', 'x' * size
+        client.set(key, value)
+
+        for limit in limits:
+            client.set_async_limit(limit)
+            client.enable_async()
+
+            def window(i):
+                for j in xrange(limit):
+                    client.get(key)
+                return len(client.async_wait())
+            try:
+                for coalescing in (True, False):
+                    client.set_get_coalescing(coalescing)
+                    yield self.run('hot get limit=%d%s' % (
+                        limit, '' if coalescing else ' off'),
+                        'get', window)
+            finally:
+                client.set_get_coalescing(False)
+                client.disable_async()
+
+    def misses(self, ratios, size):
+        client = self.client
+        keys, value = self.preload(size)
+        rng = random.Random(0)
+
+        for ratio in ratios:
+            pattern = [rng.random() < ratio for i in xrange(KEYS)]
+
+            def get(i):
+                k = i % KEYS
+                client.get(pattern[k] and 'bench:missing:%d' % k or keys[k])
+                return 1
+            yield self.run('get miss=%g' % ratio, 'get', get)
+
+
+def start_mock(options):
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        'mock_server.py')
+    args = [sys.executable, path, '--latency-ms', str(options.latency_ms),
+            '--error-rate', str(options.error_rate)]
+    mock = subprocess.Popen(args, stdout=subprocess.PIPE)
+    line = mock.stdout.readline()
+    match = re.match(r'listening rest=(\d+) data=(\d+)', line)
+    if not match:
+        mock.kill()
+        raise SystemExit('mock server failed to start: %r' % line)
+    return mock, '127.0.0.1:%s' % match.group(1)
+
+
+def report(result, baseline):
+    line = '%-24s %12.0f %10d %10d %10d' % (
+        result['name'], result['ops_per_sec'], result['p50'], result['p99'],
+        result['p99.9'])
+    before = baseline.get(result['name'])
+    if before and before['ops_per_sec']:
+        line += ' %+9.1f%%' % (
+            100.0 * (result['ops_per_sec'] / before['ops_per_sec'] - 1))
+    print line
+    sys.stdout.flush()
+
+
+def main():
+    parser = OptionParser()
+    parser.add_option('--host', default=None,
+                      help='use a running server instead of the mock')
+    parser.add_option('--seconds', type='float', default=2.0,
+                      help='duration of each scenario')
+    parser.add_option('--sizes', default='16,256,4096,65536,1048576',
+                      help='value sizes in bytes')
+    parser.add_option('--limits', default='1,16,128,1024',
+                      help='async limits for the pipeline scenarios')
+    parser.add_option('--miss-ratios', default='0,0.5,1',
+                      help='fractions of gets for missing keys')
+    parser.add_option('--latency-ms', type='float', default=0.0,
+                      help='response delay injected by the mock')
+    parser.add_option('--error-rate', type='float', default=0.0,
+                      help='fraction of requests failed by the mock')
+    parser.add_option('--only', default=None,
+                      help='regular expression selecting scenarios')
+    parser.add_option('--json', default=None,
+                      help='write results to this file')
+    parser.add_option('--compare', default=None,
+                      help='results file of an earlier run to compare with')
+    options, args = parser.parse_args()
+
+    baseline = {}
+    if options.compare:
+        with open(options.compare) as f:
+            baseline = dict((r['name'], r) for r in json.load(f)['results'])
+
+    mock = None
+    host = options.host
+    if not host:
+        mock, host = start_mock(options)
+
+    try:
+        suite = Suite(Client(host), options.seconds, options.only)
+        scenarios = [
+            suite.sizes(parse_list(options.sizes, int)),
+            suite.pipelines(parse_list(options.limits, int), 256),
+            suite.hot_key(parse_list(options.limits, int), 256),
+            suite.misses(parse_list(options.miss_ratios, float), 256),
+        ]
+
+        print '%-24s %12s %10s %10s %10s%s' % (
+            'scenario', 'ops/s', 'p50 us', 'p99 us', 'p99.9 us',
+            baseline and '  vs base' or '')
+        for scenario in scenarios:
+            for result in scenario:
+                if result:
+                    report(result, baseline)
+    finally:
+        if mock:
+            mock.kill()
+            mock.wait()
+
+    if options.json:
+        with open(options.json, 'w') as f:
+            json.dump({'options': options.__dict__, 'results': suite.results},
+                      f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -1 +1,3 @@
-from pylibcb import Client
+from pylibcb import Client, FMT_JSON, FMT_PICKLE, FMT_BYTES, FMT_UTF8
+from pylibcb import COMPRESS_ZLIB, COMPRESS_LZ4
+from pool import ClientPool
@@ -0,0 +1,164 @@
+try:
+    import asyncio
+except ImportError:
+    import trollius as asyncio
+
+import _pylibcb
+
+from pylibcb import _format
+
+
+class AsyncClient(object):
+
+    """Couchbase client driven by an asyncio (or trollius) event loop.
+
+    Every operation returns a future. The connection's sockets and timers
+    are registered with the loop, so any number of coroutines can share
+    one client without blocking waits."""
+
+    def __init__(self, host='localhost', user='', password='',
+                 bucket='default', loop=None, timeout=0):
+        """Open connection to Couchbase server.
+
+        Connecting is the only blocking step; call this before the loop
+        starts serving requests.
+
+        :param host: hostname of IP address
+        :param user: administrative username (is SASL bucked is used)
+        :param password: administrative password (is SASL bucked is used)
+        :param bucket: bucket name
+        :param loop: event loop, the default loop if not given
+        :param timeout: optional deadline in milliseconds; futures of
+        operations past it fail with _pylibcb.Timeout"""
+        self.loop = loop or asyncio.get_event_loop()
+        self.timeout = int(timeout * 1000)
+        self.instance = _pylibcb.open(host, user, password, bucket, 1)
+        _pylibcb.set_transcoding(self.instance, 1)
+        _pylibcb.set_async_limit(self.instance, 16384)
+        _pylibcb.enable_async(self.instance)
+
+        self.fd = _pylibcb.loop_fd(self.instance)
+        self.timer = None
+        self.loop.add_reader(self.fd, self._step)
+
+    def _step(self):
+        if self.timer:
+            self.timer.cancel()
+            self.timer = None
+
+        # deadline and retry timers must keep firing even when a
+        # completion callback raised out of the step
+        try:
+            _pylibcb.loop_step(self.instance)
+        finally:
+            timeout = _pylibcb.loop_timeout(self.instance)
+            if timeout is not None:
+                self.timer = self.loop.call_later(timeout, self._step)
+
+    def _submit(self, operation, args, unpack=None, tail=()):
+        future = asyncio.Future(loop=self.loop)
+
+        def complete(ticket, result):
+            if future.cancelled():
+                return
+            if isinstance(result, Exception):
+                future.set_exception(result)
+            elif unpack and result is not None:
+                future.set_result(unpack(result))
+            else:
+                future.set_result(result)
+
+        operation(self.instance, *(args + (complete,) + tail))
+        # pick up timers armed by the new request. an error raised by the
+        # callback of some other request goes to the loop, not this caller
+        try:
+            self._step()
+        except Exception as e:
+            self.loop.call_exception_handler({
+                'message': 'exception in a completion callback',
+                'exception': e})
+        return future
+
+    def get(self, key):
+        """Get a value by key.
+
+        :param key: key to search for"""
+        return self._submit(_pylibcb.get, (key, self.timeout, 0, 0),
+                            lambda result: result[0])
+
+    def gat(self, key, expiry):
+        """Get and touch.
+
+        :param key: key to search for
+        :param expiry: new expiration time"""
+        return self._submit(_pylibcb.get, (key, self.timeout, expiry, 0),
+                            lambda result: result[0])
+
+    def get_cas(self, key):
+        """GET with CAS, resolving to a (value, cas) tuple.
+
+        :param key: key to search for"""
+        return self._submit(_pylibcb.get, (key, self.timeout, 0, 1))
+
+    def set(self, key, value, expiry=0, cas=0, format=None):
+        """Set a value by key.
+
+        :param key: document key
+        :param value: document value
+        :param expiry: expiration time
+        :param cas: CAS (Compare And Swap) value
+        :param format: value format (see Client.set)"""
+        return self._submit(_pylibcb.set,
+                            (key, value, expiry, cas, _format(format)),
+                            tail=(self.timeout,))
+
+    def add(self, key, value, expiry=0, format=None):
+        """Store a value only if the key does not exist yet (see set)"""
+        return self._submit(_pylibcb.add,
+                            (key, value, expiry, 0, _format(format)),
+                            tail=(self.timeout,))
+
+    def replace(self, key, value, expiry=0, cas=0, format=None):
+        """Store a value only if the key exists (see set)"""
+        return self._submit(_pylibcb.replace,
+                            (key, value, expiry, cas, _format(format)),
+                            tail=(self.timeout,))
+
+    def append(self, key, value, cas=0):
+        """Append a string to an existing value (see Client.append)"""
+        return self._submit(_pylibcb.append, (key, value, 0, cas, 0),
+                            tail=(self.timeout,))
+
+    def prepend(self, key, value, cas=0):
+        """Prepend a string to an existing value (see Client.append)"""
+        return self._submit(_pylibcb.prepend, (key, value, 0, cas, 0),
+                            tail=(self.timeout,))
+
+    def incr(self, key, delta=1, initial=None, expiry=0):
+        """Increment a counter, resolving to its new value.
+
+        :param key: counter key
+        :param delta: amount to add, may be negative
+        :param initial: value stored if the key does not exist
+        :param expiry: expiration time, used when the counter is created"""
+        return self._submit(_pylibcb.arithmetic,
+                            (key, delta, initial or 0,
+                             int(initial is not None), expiry),
+                            tail=(self.timeout,))
+
+    def decr(self, key, delta=1, initial=None, expiry=0):
+        """Decrement a counter, resolving to its new value (see incr)"""
+        return self.incr(key, -delta, initial, expiry)
+
+    def remove(self, key):
+        """Remove a value by key
+
+        :param key: key of document to be removed"""
+        return self._submit(_pylibcb.remove, (key, 0), tail=(self.timeout,))
+
+    def close(self):
+        """Stop watching the connection from the event loop"""
+        if self.timer:
+            self.timer.cancel()
+            self.timer = None
+        self.loop.remove_reader(self.fd)
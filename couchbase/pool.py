@@ -0,0 +1,208 @@
+import sys
+import threading
+import time
+from contextlib import contextmanager
+
+import _pylibcb
+
+from pylibcb import Client
+
+
+class ClientPool(object):
+
+    """Thread-safe pool of Couchbase clients.
+
+    Every client owns its own event loop and libcouchbase instance, so a
+    client must only be used by one thread at a time. The pool keeps
+    between min_size and max_size clients open and hands them out with
+    checkout/checkin (or the connection() context manager)."""
+
+    def __init__(self, host='localhost', user='', password='',
+                 bucket='default', timeout=0, min_size=1, max_size=8,
+                 idle_timeout=60):
+        """Open min_size connections to Couchbase server.
+
+        :param host: hostname of IP address
+        :param user: administrative username (is SASL bucked is used)
+        :param password: administrative password (is SASL bucked is used)
+        :param bucket: bucket name
+        :param timeout: optional timeout in milliseconds
+        :param min_size: number of clients kept open at all times
+        :param max_size: maximum number of clients
+        :param idle_timeout: seconds an idle client above min_size is kept"""
+        if min_size < 0 or max_size < 1 or min_size > max_size:
+            raise ValueError('need 0 <= min_size <= max_size and max_size > 0')
+
+        self.params = (host, user, password, bucket, timeout)
+        self.min_size = min_size
+        self.max_size = max_size
+        self.idle_timeout = idle_timeout
+
+        self.lock = threading.Condition()
+        self.idle = []  # (client, checkin time), most recently used last
+        self.size = 0
+        self.in_use = 0
+        self.counters = dict.fromkeys(('checkouts', 'waits', 'wait_time',
+                                       'max_wait_time', 'opened', 'closed',
+                                       'broken', 'busy_time'), 0)
+        self.started = time.time()
+        self.last_change = self.started
+
+        for _ in xrange(min_size):
+            self.idle.append((self._open(), self.started))
+            self.size += 1
+            self.counters['opened'] += 1
+
+    def _open(self):
+        return Client(*self.params)
+
+    def _account(self, now):
+        """Integrate the number of clients in use over time."""
+        self.counters['busy_time'] += self.in_use * (now - self.last_change)
+        self.last_change = now
+
+    def _shrink(self, now):
+        while self.size > self.min_size and self.idle \
+                and now - self.idle[0][1] > self.idle_timeout:
+            self.idle.pop(0)
+            self.size -= 1
+            self.counters['closed'] += 1
+
+    def checkout(self, timeout=None):
+        """Take a client out of the pool, opening a new one if none are
+        idle and the pool is below max_size.
+
+        :param timeout: optional number of seconds to wait for a client"""
+        start = time.time()
+        waited = False
+
+        with self.lock:
+            while not self.idle and self.size >= self.max_size:
+                remaining = None
+                if timeout is not None:
+                    remaining = start + timeout - time.time()
+                    if remaining <= 0:
+                        raise _pylibcb.Timeout('timeout in checkout')
+                waited = True
+                self.lock.wait(remaining)
+
+            now = time.time()
+            if waited:
+                wait_time = now - start
+                self.counters['waits'] += 1
+                self.counters['wait_time'] += wait_time
+                self.counters['max_wait_time'] = max(
+                    self.counters['max_wait_time'], wait_time)
+
+            self._account(now)
+            self.counters['checkouts'] += 1
+            self.in_use += 1
+
+            if self.idle:
+                return self.idle.pop()[0]
+            self.size += 1
+
+        # connecting takes a full round trip, so do it outside the lock
+        try:
+            client = self._open()
+        except:
+            with self.lock:
+                self._account(time.time())
+                self.size -= 1
+                self.in_use -= 1
+                self.lock.notify()
+            raise
+
+        with self.lock:
+            self.counters['opened'] += 1
+        return client
+
+    def checkin(self, client, broken=False):
+        """Return a client to the pool.
+
+        :param client: client obtained from checkout
+        :param broken: discard the client (e.g. after ConnectionFailure)"""
+        with self.lock:
+            now = time.time()
+            self._account(now)
+            self.in_use -= 1
+
+            if broken:
+                self.size -= 1
+                self.counters['broken'] += 1
+                self.counters['closed'] += 1
+            else:
+                self.idle.append((client, now))
+
+            self._shrink(now)
+            self.lock.notify()
+
+        if broken:
+            self.health_check()
+
+    def health_check(self):
+        """Reopen clients until the pool is back at min_size.
+
+        Stops quietly if the server cannot be reached and re-raises other
+        errors; either way the slot reserved for the new client is given
+        back. Idle clients are not probed: libcouchbase has no no-op
+        request, so a probe would cost a real round trip on every
+        checkout. A client whose connection went away raises
+        ConnectionFailure on its next use instead, and connection()
+        discards it and calls this to refill the pool."""
+        while True:
+            with self.lock:
+                if self.size >= self.min_size:
+                    return
+                self.size += 1
+            try:
+                client = self._open()
+            except:
+                with self.lock:
+                    self.size -= 1
+                    self.lock.notify()
+                if sys.exc_info()[0] is _pylibcb.ConnectionFailure:
+                    return
+                raise
+            with self.lock:
+                self.counters['opened'] += 1
+                self.idle.append((client, time.time()))
+                self.lock.notify()
+
+    @contextmanager
+    def connection(self, timeout=None):
+        """Context manager around checkout/checkin. Clients that raise
+        ConnectionFailure are discarded instead of returned to the pool.
+
+        :param timeout: optional number of seconds to wait for a client"""
+        client = self.checkout(timeout)
+        try:
+            yield client
+        except _pylibcb.ConnectionFailure:
+            # the caller sees its own error, not one from refilling the pool
+            error = sys.exc_info()
+            try:
+                self.checkin(client, broken=True)
+            finally:
+                raise error[0], error[1], error[2]
+        except:
+            self.checkin(client)
+            raise
+        else:
+            self.checkin(client)
+
+    def stats(self):
+        """Get pool size, wait time and utilisation counters"""
+        with self.lock:
+            now = time.time()
+            self._account(now)
+            stats = dict(self.counters)
+            stats.update(size=self.size, idle=len(self.idle),
+                         in_use=self.in_use, min_size=self.min_size,
+                         max_size=self.max_size)
+            elapsed = now - self.started
+            # average fraction of max_size checked out since the pool opened
+            stats['utilisation'] = (stats['busy_time'] /
+                                    (elapsed * self.max_size)
+                                    if elapsed else 0.0)
+            return stats
@@ -1,4 +1,5 @@
 #include <Python.h>
+#include <structmember.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -7,6 +8,20 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 char *asciiz(const void *data, size_t nbytes) {
   char *z = malloc(nbytes+1);
@@ -20,16 +35,16 @@ static PyObject *OutOfMemory;
 static PyObject *ConnectionFailure;
 static PyObject *Failure;
 static PyObject *KeyExists;
+static PyObject *NotFound;
 static PyObject *AsyncLimit;
 
-#define ASYNC_GUARD() if (context->async_mode) {		\
-    if (context->async_count >= context->async_limit) {		\
-      PyErr_SetString(AsyncLimit, "async limit reached");	\
-      return 0;							\
-    } else if (context->async.count == context->async.size) {	\
-      PyErr_SetString(AsyncLimit, "too many results pending");	\
-      return 0;							\
-    }								\
+#define ASYNC_GUARD() if (context->async_mode			\
+			   && async_backpressure(context, 1))	\
+    return 0;
+
+#define IO_THREAD_GUARD(what) if (context->io.running) {		\
+    PyErr_SetString(Failure, what " cannot be used with an I/O thread"); \
+    return 0;								\
   }
 
 #define ASYNC_EXIT(ticket) if(context->async_mode) { \
@@ -53,76 +68,142 @@ static PyObject *AsyncLimit;
     }						\
   }
 
-/* allocators for commonly held objects */
-
-#define SLAB_SIZE 256
-
-typedef struct t_event_list {
-  struct event ev;
-  struct t_event_list *next;
-} event_list;
-
-typedef struct t_event_slab {
-  int count;
-  int used;
-  event_list *slab;
-  struct t_event_slab *next;
-} event_slab;
-
-event_slab *new_event_slab(struct t_event_slab *next) {
-  event_slab *x = calloc(1, sizeof(event_slab) + sizeof(event_list) * SLAB_SIZE);
-  if (!x)
-    return 0;
+/* every operation's state lives in one record of a per-instance arena:
+   its ticket, the timer of async_wait and async_poll deadlines, the
+   deadline wheel links, op type and start time. records are carved out of
+   chunks in address order. once nothing is outstanding after a batch the
+   arena is reset, so the next batch walks its records sequentially
+   again, and chunks above the high water mark of the last batch are
+   returned to the system */
 
-  x->slab = (void *) x + sizeof(event_slab);
-  x->count = SLAB_SIZE - 1;
-  x->next = next;
-  return x;
-}
+#define ARENA_CHUNK 256
+#define TRACE_KEY 48
 
-void destroy_event_slab(struct t_event_slab *t) {
-  event_slab *n;
-  while (t) {
-    n = t->next;
-    free(t);
-    t = n;
-  }
-}
+struct t_pylibcb_instance;
 
 typedef struct t_ticket {  
   int ticket[2];
-  struct t_event_list *ev;
+  struct t_pylibcb_instance *instance;
+  int pending;
+  int return_cas;
+  int submitting;
+  int expired;
+  int async; /* submitted in async mode */
+  int op;
+  unsigned long long start;
+  /* kept for the trace while it is enabled, the key is copied at submit so
+     ops that time out can be recorded too */
+  unsigned int flush_gen; /* trace_log generation at submit */
+  Py_ssize_t size; /* bytes sent, or received by a get */
+  unsigned long long called; /* 0 if libcouchbase never called back */
+  int traced_op;
+  libcouchbase_size_t nkey;
+  char key[TRACE_KEY];
+  struct t_ticket *held_next;
+  PyObject *multi;
+  PyObject *keys;
+  PyObject *callback;
+  int timer_set;
+  struct event timer;
+  unsigned long long deadline;
+  struct t_ticket *wheel_next;
+  struct t_ticket **wheel_link;
+  struct t_request *requests;
+  struct t_bulk *bulk;
+  struct t_inflight *inflight; /* entry of a get others can join */
+  struct t_ticket *followers; /* gets waiting for this one's response */
+  struct t_ticket *follower_next;
   struct t_ticket *next;
 } ticket;
 
-typedef struct t_ticket_slab {
-  int count;
-  int used;
-  ticket *slab;
-  struct t_ticket_slab *next;
-} ticket_slab;
+typedef struct t_op_chunk {
+  struct t_op_chunk *next;
+  int used; /* records carved out since the last reset */
+  ticket ops[ARENA_CHUNK];
+} op_chunk;
+
+typedef struct t_op_arena {
+  op_chunk *chunks; /* oldest first */
+  op_chunk *current; /* chunks after it are untouched */
+  ticket *free; /* records released since the last reset */
+  int nchunks;
+  int in_use;
+  int high_water; /* most records in use since the last reset */
+  unsigned long long resets;
+  unsigned long long trimmed; /* chunks returned */
+} op_arena;
+
+void arena_destroy(op_arena *a) {
+  op_chunk *c, *n;
+
+  for (c = a->chunks; c; c = n) {
+    n = c->next;
+    free(c);
+  }
+  memset(a, 0, sizeof(op_arena));
+}
 
-ticket_slab *new_ticket_slab(struct t_ticket_slab *next) {
-  ticket_slab *x = calloc(1, sizeof(ticket_slab) + sizeof(ticket) * SLAB_SIZE);
-  if (!x)
-    return 0;
+/* async structures */
 
-  x->slab = (void *) x + sizeof(ticket_slab);
-  x->count = SLAB_SIZE - 1;
-  x->next = next;
-  return x;
-}
+/* what a request needs to be sent again, kept while a retry policy is set */
+
+typedef struct t_request {
+  struct t_request *next; /* requests of the same ticket */
+  struct t_request *retry_next; /* requests waiting for their backoff */
+  ticket *ticket;
+  int kind; /* OP_GET etc */
+  libcouchbase_storage_t operation;
+  PyObject *value;
+  libcouchbase_uint32_t flags;
+  libcouchbase_time_t expiry;
+  libcouchbase_cas_t cas;
+  libcouchbase_int64_t delta;
+  libcouchbase_uint64_t initial;
+  int create;
+  int attempts;
+  unsigned long long started;
+  unsigned long long due;
+  struct event ev;
+  libcouchbase_size_t nkey;
+  char key[1];
+} request;
+
+void free_requests(ticket *t) {
+  struct t_request *r, *n;
 
-void destroy_ticket_slab(struct t_ticket_slab *t) {
-  ticket_slab *n;
-  while (t) {
-    n = t->next;
-    free(t);
-    t = n;
+  for (r = t->requests; r; r = n) {
+    n = r->next;
+    Py_XDECREF(r->value);
+    free(r);
   }
+  t->requests = 0;
 }
 
-/* async structures */
+/* bulk jobs move records between files and the cluster without a python
+   object per record, only failures are kept and only up to a limit */
+
+typedef struct t_bulk {
+  int window; /* requests in flight, 0 follows the async limit */
+  Py_ssize_t max_failures;
+  unsigned long long done;
+  unsigned long long failed;
+  unsigned long long missing;
+  unsigned long long bytes;
+  PyObject *failures; /* key -> exception */
+  FILE *out; /* exported records */
+  FILE *errors; /* keys that were missing or failed, may be 0 */
+  int write_error; /* first errno writing either file */
+} bulk_job;
+
+void free_bulk(ticket *t) {
+  Py_XDECREF(t->bulk->failures);
+  if (t->bulk->out)
+    fclose(t->bulk->out);
+  if (t->bulk->errors)
+    fclose(t->bulk->errors);
+  free(t->bulk);
+  t->bulk = 0;
+}
 
 typedef struct t_async_result {
   int ticket;
@@ -165,54 +246,489 @@ int async_size(async_results *x, int size) {
   return 0;
 }
 
-void async_push(async_results *x, int ticket, PyObject *value) {
+/* the buffer grows when results arrive faster than they are collected,
+   it owns the reference to every value it holds */
+int async_push(async_results *x, int ticket, PyObject *value) {
+  if (x->count == x->size && async_size(x, x->size ? x->size * 2 : 64))
+    return -1;
+
   x->count++;
   x->buffer[x->end].ticket = ticket;
   x->buffer[x->end].value = value;
   x->end = (x->end + 1) % x->size;
+  return 0;
 }
 
-int process_async_results(async_results *x, int (*f)(async_result *)) {
+void async_clear(async_results *x) {
   while (x->count) {
-    if (f(&x->buffer[x->start]))
+    Py_DECREF(x->buffer[x->start].value);
+    x->start = (x->start + 1) % x->size;
+    x->count--;
+  }
+  free(x->buffer);
+}
+
+int process_async_results(async_results *x, int (*f)(async_result *, PyObject *, Py_ssize_t), PyObject *rval, int limit) {
+  Py_ssize_t i = 0;
+  while (x->count && limit--) {
+    if (f(&x->buffer[x->start], rval, i++))
       return -1;
     x->start = (x->start + 1) % x->size;
     x->count--;
   } return 0;
 }
 
-PyObject *_async_rval;
-
-int begin_async_results() {
-  _async_rval = PyList_New(0);
-  if (!_async_rval) {
-    PyErr_SetString(Failure, "begin_async_results");
+/* moves the value's reference into a (ticket, value) tuple in slot i */
+int process_async_result(async_result *x, PyObject *rval, Py_ssize_t i) {
+  PyObject *t = PyTuple_New(2);
+  PyObject *n = PyInt_FromLong(x->ticket);
+  if (!t || !n) {
+    Py_XDECREF(t);
+    Py_XDECREF(n);
     return -1;
-  } return 0;
+  }
+
+  PyTuple_SET_ITEM(t, 0, n);
+  PyTuple_SET_ITEM(t, 1, x->value);
+  PyList_SET_ITEM(rval, i, t);
+  return 0;
 }
 
-int process_async_result(async_result *x) {
-  PyObject *t = PyTuple_Pack(2, PyInt_FromLong(x->ticket), x->value);
-  if (!t) {
-    PyErr_SetString(Failure, "process_async_result");
+/* io ops wrapper letting a foreign event loop (e.g. asyncio) drive an
+   instance: socket interest is mirrored into an epoll set whose fd the
+   foreign loop watches, and timer deadlines are tracked so it can wake
+   up in time. both are then dispatched with a non-blocking loop step */
+
+#ifdef __linux__
+
+typedef struct t_loop_timer {
+  void *timer;
+  struct timeval deadline;
+} loop_timer;
+
+typedef struct t_loop_io {
+  libcouchbase_io_opt_t io; /* must be first, handed to libcouchbase */
+  libcouchbase_io_opt_t *inner;
+  int epfd;
+  int ntimers;
+  int timer_slots;
+  loop_timer *timers;
+} loop_io;
+
+int loop_update_event(libcouchbase_io_opt_t *iops,
+		      libcouchbase_socket_t sock,
+		      void *event,
+		      short flags,
+		      void *cb_data,
+		      void (*handler)(libcouchbase_socket_t sock, short which, void *cb_data)) {
+  loop_io *l = (loop_io *) iops;
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = (flags & LIBCOUCHBASE_READ_EVENT ? EPOLLIN : 0) | (flags & LIBCOUCHBASE_WRITE_EVENT ? EPOLLOUT : 0);
+  ev.data.fd = sock;
+  if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, sock, &ev) && errno == ENOENT)
+    epoll_ctl(l->epfd, EPOLL_CTL_ADD, sock, &ev);
+
+  return l->inner->update_event(iops, sock, event, flags, cb_data, handler);
+}
+
+void loop_delete_event(libcouchbase_io_opt_t *iops, libcouchbase_socket_t sock, void *event) {
+  loop_io *l = (loop_io *) iops;
+  struct epoll_event ev;
+
+  epoll_ctl(l->epfd, EPOLL_CTL_DEL, sock, &ev);
+  l->inner->delete_event(iops, sock, event);
+}
+
+void loop_forget_timer(loop_io *l, void *timer) {
+  int i;
+  for (i = 0; i < l->ntimers; ++i)
+    if (l->timers[i].timer == timer) {
+      l->timers[i] = l->timers[--l->ntimers];
+      return;
+    }
+}
+
+int loop_update_timer(libcouchbase_io_opt_t *iops,
+		      void *timer,
+		      libcouchbase_uint32_t usec,
+		      void *cb_data,
+		      void (*handler)(libcouchbase_socket_t sock, short which, void *cb_data)) {
+  loop_io *l = (loop_io *) iops;
+  struct timeval now, tmo;
+
+  loop_forget_timer(l, timer);
+  if (l->ntimers == l->timer_slots) {
+    loop_timer *n = realloc(l->timers, sizeof(loop_timer) * (l->timer_slots + 8));
+    if (!n)
+      return -1;
+    l->timers = n;
+    l->timer_slots += 8;
+  }
+
+  gettimeofday(&now, 0);
+  tmo.tv_sec = usec / 1000000;
+  tmo.tv_usec = usec % 1000000;
+  l->timers[l->ntimers].timer = timer;
+  timeradd(&now, &tmo, &l->timers[l->ntimers].deadline);
+  ++l->ntimers;
+
+  return l->inner->update_timer(iops, timer, usec, cb_data, handler);
+}
+
+void loop_delete_timer(libcouchbase_io_opt_t *iops, void *timer) {
+  loop_forget_timer((loop_io *) iops, timer);
+  ((loop_io *) iops)->inner->delete_timer(iops, timer);
+}
+
+void loop_destroy_timer(libcouchbase_io_opt_t *iops, void *timer) {
+  loop_forget_timer((loop_io *) iops, timer);
+  ((loop_io *) iops)->inner->destroy_timer(iops, timer);
+}
+
+void loop_destructor(libcouchbase_io_opt_t *iops) {
+  loop_io *l = (loop_io *) iops;
+
+  close(l->epfd);
+  free(l->timers);
+  if (l->inner->destructor)
+    l->inner->destructor(l->inner);
+  free(l);
+}
+
+libcouchbase_io_opt_t *wrap_io_ops(libcouchbase_io_opt_t *inner) {
+  loop_io *l = calloc(1, sizeof(loop_io));
+  if (!l)
+    return 0;
+
+  l->epfd = epoll_create(16);
+  if (l->epfd == -1) {
+    free(l);
     return 0;
   }
 
-  return PyList_Append(_async_rval, t);
+  l->io = *inner;
+  l->inner = inner;
+  l->io.update_event = loop_update_event;
+  l->io.delete_event = loop_delete_event;
+  l->io.update_timer = loop_update_timer;
+  l->io.delete_timer = loop_delete_timer;
+  l->io.destroy_timer = loop_destroy_timer;
+  l->io.destructor = loop_destructor;
+  return &l->io;
+}
+
+/* timers are one-shot, so anything due before a loop step has fired */
+void loop_expire_timers(loop_io *l, struct timeval *before) {
+  int i = 0;
+  while (i < l->ntimers)
+    if (!timercmp(&l->timers[i].deadline, before, >))
+      l->timers[i] = l->timers[--l->ntimers];
+    else
+      ++i;
+}
+
+/* seconds until the earliest pending timer, or -1 if there is none */
+double loop_next_timeout(loop_io *l) {
+  struct timeval now, left;
+  double next = -1;
+  int i;
+
+  gettimeofday(&now, 0);
+  for (i = 0; i < l->ntimers; ++i) {
+    timersub(&l->timers[i].deadline, &now, &left);
+    double t = left.tv_sec < 0 ? 0 : left.tv_sec + left.tv_usec / 1e6;
+    if (next < 0 || t < next)
+      next = t;
+  }
+
+  return next;
+}
+
+#endif
+
+/* operation deadlines are kept on a hashed timer wheel with one slot per
+   millisecond, so a single libevent timer serves every op in flight.
+   deadlines more than a turn away stay in their slot until a later pass */
+
+#define WHEEL_SLOTS 512
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+typedef struct t_timer_wheel {
+  ticket *slots[WHEEL_SLOTS];
+  unsigned long long now; /* last tick processed */
+  unsigned long long next; /* tick the timer is armed for, 0 if disarmed */
+  int count;
+  struct event ev;
+} timer_wheel;
+
+/* per instance measurements: submit to completion latency per op type in
+   log-bucketed histograms with 16 linear sub-buckets per power of two
+   (about 6% relative error), plus plain counters. multi-key and bulk calls
+   have histograms of their own, one sample per call, so a large batch does
+   not show up as one slow single-key op */
+
+#define OP_NONE -1
+#define OP_GET 0
+#define OP_GAT 1
+#define OP_SET 2
+#define OP_REMOVE 3
+#define OP_ARITHMETIC 4
+#define OP_TYPES 5
+
+static const char *op_names[OP_TYPES] = { "get", "gat", "set", "remove", "arithmetic" };
+static const char *storage_names[] = { 0, "add", "replace", "set", "append", "prepend" };
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((33 - HIST_SUB_BITS) << HIST_SUB_BITS) /* up to 2^32 usecs */
+
+#define ERROR_SLOTS 64
+
+typedef struct t_histogram {
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long min;
+  unsigned long long max;
+  unsigned long long buckets[HIST_BUCKETS];
+} histogram;
+
+typedef struct t_op_stats {
+  histogram latency[OP_TYPES];
+  histogram batches[OP_TYPES];
+  unsigned long long ops[OP_TYPES];
+  unsigned long long bytes_sent;
+  unsigned long long bytes_received;
+  unsigned long long misses;
+  unsigned long long timeouts;
+  unsigned long long errors[ERROR_SLOTS];
+  unsigned long long compressed;
+  unsigned long long compress_skipped;
+  unsigned long long compress_in;
+  unsigned long long compress_out;
+  unsigned long long compress_usec;
+  unsigned long long decompressed;
+  unsigned long long decompress_usec;
+  unsigned long long near_hits;
+  unsigned long long near_misses;
+  unsigned long long near_evictions;
+  unsigned long long near_expirations;
+  unsigned long long near_invalidations;
+  unsigned long long retries;
+  unsigned long long retries_exhausted;
+  unsigned long long coalesce_sent; /* gets others could join */
+  unsigned long long coalesced; /* gets answered by another's request */
+} op_stats;
+
+/* optional near cache of values read through the instance, a hash table
+   with least recently used eviction bounded by entries and bytes. entries
+   keep the stored bytes, flags and cas, expire after a fixed local ttl and
+   are dropped by writes through the same instance */
+
+typedef struct t_near_entry {
+  struct t_near_entry *chain; /* next in hash bucket */
+  struct t_near_entry *prev; /* lru order, most recently used first */
+  struct t_near_entry *next;
+  unsigned int hash;
+  PyObject *bytes;
+  libcouchbase_uint32_t flags;
+  libcouchbase_cas_t cas;
+  unsigned long long expires;
+  Py_ssize_t size;
+  libcouchbase_size_t nkey;
+  char key[1];
+} near_entry;
+
+typedef struct t_near_cache {
+  near_entry **buckets; /* 0 when disabled */
+  unsigned int mask;
+  near_entry *head;
+  near_entry *tail;
+  int entries;
+  int max_entries;
+  Py_ssize_t bytes;
+  Py_ssize_t max_bytes;
+  unsigned long long ttl;
+} near_cache;
+
+/* async gets of a key that already has a get in flight on the instance
+   join it instead of sending their own request, and its response is
+   handed to each of them. a key stops taking new joiners when the
+   response arrives, the leading get expires or a write of the key is
+   submitted, so no get sees data older than the last write issued
+   before it */
+
+#define COALESCE_MIN_BUCKETS 64
+
+typedef struct t_inflight {
+  struct t_inflight *chain;
+  struct t_ticket *leader;
+  unsigned int hash;
+  libcouchbase_size_t nkey;
+  char key[1];
+} inflight;
+
+typedef struct t_coalescer {
+  int enabled; /* off unless asked for */
+  inflight **buckets; /* allocated on first use */
+  unsigned int mask;
+  int entries;
+} coalescer;
+
+/* optional trace of slow single-key operations: a ring keeping the last
+   entries whose submit to delivery time reached a threshold, with the end
+   of each phase. the flush is the first event loop run after the request
+   was queued, which is when libcouchbase writes it out */
+
+#define TRACE_FLUSHES 64
+
+typedef struct t_trace_entry {
+  int op;
+  libcouchbase_size_t nkey; /* untruncated */
+  char key[TRACE_KEY];
+  Py_ssize_t size; /* bytes received for gets, sent otherwise */
+  unsigned long long submit;
+  unsigned long long flush; /* 0 if not known */
+  unsigned long long callback;
+  unsigned long long deliver;
+  int expired;
+} trace_entry;
+
+typedef struct t_trace_log {
+  trace_entry *ring; /* 0 when disabled */
+  int size;
+  unsigned long long threshold;
+  unsigned long long written;
+  unsigned long long read;
+  unsigned long long overwritten;
+  unsigned int gen; /* loop runs that had new requests to flush */
+  int unflushed;
+  unsigned long long flushes[TRACE_FLUSHES];
+  /* the libcouchbase callback being handled */
+  unsigned long long called;
+  libcouchbase_size_t received;
+  /* synchronous ops are delivered when their wait returns, their tickets
+     are held until then */
+  struct t_ticket *held;
+  struct t_ticket **held_last;
+} trace_log;
+
+/* adaptive async window: the limit grows by one request per window's
+   worth of completions and halves on timeouts, temporary failures or when
+   an epoch's p99 latency climbs well above its running baseline. an epoch
+   lasts at least one window of completions and the window is cut at most
+   once per epoch */
+
+#define AIMD_HISTORY 32
+#define AIMD_MIN_EPOCH 32
+#define AIMD_LATENCY_FACTOR 2
+
+typedef struct t_aimd_event {
+  double time;
+  int from;
+  int to;
+  const char *reason;
+} aimd_event;
+
+typedef struct t_aimd {
+  int enabled;
+  double window;
+  int min;
+  int max;
+  int cut; /* window already cut in this epoch */
+  int epoch_window;
+  unsigned long long baseline; /* usecs, 0 until the first epoch ends */
+  unsigned long long increases;
+  unsigned long long decreases;
+  int history_next;
+  aimd_event history[AIMD_HISTORY];
+  histogram epoch;
+} aimd;
+
+/* transient failures (ETMPFAIL, EBUSY, NOT_MY_VBUCKET) can be retried
+   inside the extension. while a retry policy is set every request keeps
+   what it needs to be sent again, and a failed one is resubmitted on its
+   own ticket from a timer after an exponential, jittered backoff */
+
+typedef struct t_retry_policy {
+  int attempts; /* 0 or 1 disable retries */
+  unsigned int backoff; /* usecs before the first retry */
+  unsigned int max_backoff;
+  unsigned int deadline; /* usecs after the first attempt */
+  unsigned long long seed;
+  request *waiting;
+} retry_policy;
+
+/* requests still waiting out their backoff when the instance goes away;
+   each is unlinked from its ticket before its timer and record are freed */
+void retry_clear(retry_policy *p) {
+  request *r, **link;
+
+  while ((r = p->waiting)) {
+    p->waiting = r->retry_next;
+    event_del(&r->ev);
+    for (link = &r->ticket->requests; *link != r; link = &(*link)->next)
+      ;
+    *link = r->next;
+    Py_XDECREF(r->value);
+    free(r);
+  }
 }
 
+/* with an I/O thread the event loop and libcouchbase instance belong to
+   a native thread. python threads push ops onto a lock-free stack, wake
+   the thread through an eventfd (a socket pair off linux) and wait for their op
+   to complete without the GIL. the thread never touches python objects;
+   results are copied into the op and decoded by the waiting thread */
+
+typedef struct t_io_op {
+  struct t_io_op *next;
+  int kind; /* OP_GET etc */
+  libcouchbase_storage_t operation;
+  libcouchbase_uint32_t flags;
+  libcouchbase_time_t expiry;
+  libcouchbase_cas_t cas;
+  libcouchbase_int64_t delta;
+  libcouchbase_uint64_t initial;
+  int create;
+  int refs; /* the waiting thread and the I/O thread, changed atomically */
+  int done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  libcouchbase_error_t error;
+  libcouchbase_uint32_t result_flags;
+  libcouchbase_cas_t result_cas;
+  libcouchbase_uint64_t counter;
+  char *bytes;
+  libcouchbase_size_t nbytes;
+  libcouchbase_size_t nvalue;
+  libcouchbase_size_t nkey;
+  char data[1]; /* key, then the value of stores */
+} io_op;
+
+typedef struct t_io_thread {
+  int running;
+  volatile int stop;
+  pthread_t thread;
+  int wake[2]; /* read and write ends, the same eventfd on linux */
+  struct event wake_ev;
+  io_op *volatile queue; /* newest first */
+  unsigned long long wakeups; /* written by the I/O thread only */
+  unsigned long long ops;
+} io_thread;
+
 /* structure holding all state for python client */
 
 typedef struct t_pylibcb_instance {
   int callback_ticket;
-  ticket *ticket_pool;
-  ticket_slab *ticket_slabs;
-  event_list *event_pool;
-  event_slab *event_slabs;
+  op_arena arena;
   int async_mode;
   async_results async;
   int async_count;
   int async_limit;
+  aimd adaptive;
+  retry_policy retry;
   int succeeded;
   int timed_out;
   int exception;
@@ -221,69 +737,197 @@ typedef struct t_pylibcb_instance {
   libcouchbase_error_t result;
   libcouchbase_error_t internal_error;
   libcouchbase_cas_t returned_cas;
+  const char *error_string;
+  PyObject *error_exception;
+  PyThreadState *thread_state;
+  PyThreadState *owner;
+  int waiting;
+  int in_callback;
+  PyObject *callback_error[3];
+  int transcoding;
+  int compression;
+  Py_ssize_t compress_threshold;
+  PyObject *formats;
+  int buffer_values;
+  unsigned long long copy_avoided_bytes;
+  timer_wheel wheel;
+  near_cache near;
+  coalescer coalesce;
+  trace_log trace;
+  op_stats stats;
   struct event_base *base;
+  void *loop_io;
+  io_thread io;
   libcouchbase_t cb;
 } pylibcb_instance;
 
 static char *pylibcb_instance_desc = "pylibcb_instance";
 
+void near_clear(near_cache *c) {
+  near_entry *e, *n;
+
+  for (e = c->head; e; e = n) {
+    n = e->next;
+    Py_DECREF(e->bytes);
+    free(e);
+  }
+  free(c->buckets);
+  memset(c, 0, sizeof(near_cache));
+}
+
+void coalesce_clear(coalescer *c) {
+  unsigned int i;
+  inflight *e, *n;
+
+  if (c->buckets)
+    for (i = 0; i <= c->mask; ++i)
+      for (e = c->buckets[i]; e; e = n) {
+	n = e->chain;
+	e->leader->inflight = 0;
+	free(e);
+      }
+  free(c->buckets);
+  c->buckets = 0;
+  c->mask = 0;
+  c->entries = 0;
+}
+
+void io_wake(io_thread *io) {
+  unsigned long long one = 1;
+  while (write(io->wake[1], &one, sizeof(one)) == -1 && errno == EINTR)
+    ;
+}
+
+void io_close_wake(io_thread *io) {
+  close(io->wake[0]);
+  if (io->wake[1] != io->wake[0])
+    close(io->wake[1]);
+}
+
+/* no op can be waiting here, waiters hold a reference to the instance */
+void io_stop(pylibcb_instance *z) {
+  io_thread *io = &z->io;
+
+  io->stop = 1;
+  io_wake(io);
+  Py_BEGIN_ALLOW_THREADS
+  pthread_join(io->thread, 0);
+  Py_END_ALLOW_THREADS
+  event_del(&io->wake_ev);
+  io_close_wake(io);
+  io->running = 0;
+}
+
 void pylibcb_instance_dest(void *obj, void *desc) {
   pylibcb_instance *z = (pylibcb_instance *) obj;
   
-  destroy_ticket_slab(z->ticket_slabs);
-  destroy_event_slab(z->event_slabs);
+  if (z->io.running)
+    io_stop(z);
+  event_del(&z->wheel.ev);
+  retry_clear(&z->retry);
+  near_clear(&z->near);
+  coalesce_clear(&z->coalesce);
+  free(z->trace.ring);
+  arena_destroy(&z->arena);
+  async_clear(&z->async);
+  Py_XDECREF(z->formats);
+  Py_XDECREF(z->callback_error[0]);
+  Py_XDECREF(z->callback_error[1]);
+  Py_XDECREF(z->callback_error[2]);
   libcouchbase_destroy(z->cb);
   event_base_free(z->base);
   free(z);
 }
 
-static pylibcb_instance *context = 0;
+/* the event loop runs without the GIL; callbacks take it back while they
+   touch python objects */
 
-event_list *alloc_event() {
-  event_list *ev;
+#define CALLBACK_ENTER(z) PyThreadState *_callback_state = (z)->thread_state; \
+  if (_callback_state) {						\
+    (z)->thread_state = 0;						\
+    PyEval_RestoreThread(_callback_state);				\
+  }
 
-  if (context->event_pool) {
-    ev = context->event_pool;
-    context->event_pool = ev->next;
-  } else {
-    event_slab *z = context->event_slabs;
-    
-    if (z->used == z->count) {
-      event_slab *n = new_event_slab(z);
-      if (!n)
-	return 0;
-      context->event_slabs = n;
-    }
+#define CALLBACK_EXIT(z) if (_callback_state)	\
+    (z)->thread_state = PyEval_SaveThread();
 
-    ev = &z->slab[z->used++];
-  }
+unsigned long long clock_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void coalesce_drop(coalescer *c, inflight *e) {
+  inflight **p;
+
+  for (p = &c->buckets[e->hash & c->mask]; *p != e; p = &(*p)->chain)
+    ;
+  *p = e->chain;
+  e->leader->inflight = 0;
+  --c->entries;
+  free(e);
+}
+
+op_chunk *arena_grow(op_arena *a) {
+  op_chunk *c = malloc(sizeof(op_chunk));
+  if (!c)
+    return 0;
 
-  ev->next = 0;
-  return ev;
+  c->next = 0;
+  c->used = 0;
+  if (a->current)
+    a->current->next = c;
+  else
+    a->chunks = c;
+  ++a->nchunks;
+  return a->current = c;
 }
 
-int *alloc_ticket() {
+int *alloc_ticket(pylibcb_instance *context) {
+  op_arena *a = &context->arena;
+  op_chunk *c = a->current;
   ticket *t;
 
-  if (context->ticket_pool) {
-    t = context->ticket_pool;
-    context->ticket_pool = t->next;
+  if (a->free) {
+    t = a->free;
+    a->free = t->next;
   } else {
-    ticket_slab *z = context->ticket_slabs;
-
-    if (z->used == z->count) {
-      ticket_slab *n = new_ticket_slab(z);
-      if (!n)
+    if (!c || c->used == ARENA_CHUNK) {
+      if (c && c->next)
+	c = a->current = c->next;
+      else if (!(c = arena_grow(a)))
 	return 0;
-      context->ticket_slabs = n;
     }
-
-    t = &z->slab[z->used++];
+    t = &c->ops[c->used++];
   }
 
+  if (++a->in_use > a->high_water)
+    a->high_water = a->in_use;
+
   t->ticket[0] = ++context->callback_ticket;
   t->ticket[1] = 0;
-  t->ev = 0;
+  t->instance = context;
+  t->pending = 0;
+  t->return_cas = 0;
+  t->submitting = 0;
+  t->expired = 0;
+  t->async = context->async_mode;
+  t->op = OP_NONE;
+  t->start = 0;
+  t->flush_gen = 0;
+  t->traced_op = OP_NONE;
+  t->multi = 0;
+  t->keys = 0;
+  t->callback = 0;
+  t->timer_set = 0;
+  t->deadline = 0;
+  t->wheel_next = 0;
+  t->wheel_link = 0;
+  t->requests = 0;
+  t->bulk = 0;
+  t->inflight = 0;
+  t->followers = 0;
+  t->follower_next = 0;
   t->next = 0;
 
   return (int *) t;  
@@ -298,64 +942,515 @@ int rip_ticket(int *t) {
   int r = t[0];
   if (!--t[1]) {
     ticket *_t = (ticket *) t;
-    if (_t->ev) {
-      event_del(&_t->ev->ev);
-      _t->ev->next = context->event_pool;
-      context->event_pool = _t->ev;
+    op_arena *a = &_t->instance->arena;
+    if (_t->timer_set) {
+      event_del(&_t->timer);
+      _t->timer_set = 0;
+    }
+    if (_t->multi) {
+      Py_DECREF(_t->multi);
+      _t->multi = 0;
     }
-    _t->next = context->ticket_pool;
-    context->ticket_pool = _t;
+    if (_t->keys) {
+      Py_DECREF(_t->keys);
+      _t->keys = 0;
+    }
+    if (_t->callback) {
+      Py_DECREF(_t->callback);
+      _t->callback = 0;
+    }
+    if (_t->requests)
+      free_requests(_t);
+    if (_t->bulk)
+      free_bulk(_t);
+    if (_t->inflight)
+      coalesce_drop(&_t->instance->coalesce, _t->inflight);
+    _t->next = a->free;
+    a->free = _t;
+    --a->in_use;
   } return r;
 }
 
-void timeout_callback(libcouchbase_socket_t sock, short which, void *cb_data) {
-  if (rip_ticket((int *) cb_data) != context->callback_ticket)
+/* called between batches. with no record outstanding every chunk is
+   empty, so the free list is dropped and chunks are carved from the start
+   again; only as many chunks as the last batch needed are kept */
+void arena_reset(op_arena *a) {
+  op_chunk *c, *n;
+  int keep = (a->high_water + ARENA_CHUNK - 1) / ARENA_CHUNK, i = 0;
+
+  if (a->in_use || !a->chunks)
     return;
 
-  /* mark current operation as timed out and break the event loop */
- 
-  context->timed_out = 1;
-  event_base_loopbreak(context->base);
+  if (keep < 1)
+    keep = 1;
+  for (c = a->chunks; c; c = n) {
+    n = c->next;
+    if (++i > keep) {
+      free(c);
+      --a->nchunks;
+      ++a->trimmed;
+      continue;
+    }
+    c->used = 0;
+    if (i == keep)
+      c->next = 0;
+  }
+
+  a->current = a->chunks;
+  a->free = 0;
+  a->high_water = 0;
+  ++a->resets;
+}
+
+void trace_flush(trace_log *l) {
+  if (!l->unflushed)
+    return;
+  l->flushes[++l->gen % TRACE_FLUSHES] = clock_usec();
+  l->unflushed = 0;
+}
+
+/* the entry is only filled for ops past the threshold */
+void trace_commit(trace_log *l, ticket *t, unsigned long long deliver) {
+  unsigned int flushed = l->gen - t->flush_gen;
+  trace_entry *e;
+
+  if (deliver - t->start < l->threshold)
+    return;
+
+  e = &l->ring[l->written++ % l->size];
+  if (l->written - l->read > (unsigned long long) l->size) {
+    ++l->read;
+    ++l->overwritten;
+  }
+  e->op = t->traced_op;
+  e->nkey = t->nkey;
+  memcpy(e->key, t->key, t->nkey < TRACE_KEY ? t->nkey : TRACE_KEY);
+  e->size = t->size;
+  e->submit = t->start;
+  e->flush = flushed && flushed <= TRACE_FLUSHES ? l->flushes[(t->flush_gen + 1) % TRACE_FLUSHES] : 0;
+  e->callback = t->called;
+  e->deliver = deliver;
+  e->expired = t->expired;
+}
+
+void trace_deliver(trace_log *l) {
+  unsigned long long now = clock_usec();
+  ticket *t, *n;
+
+  for (t = l->held; t; t = n) {
+    n = t->held_next;
+    if (l->ring)
+      trace_commit(l, t, now);
+    rip_ticket((int *) t);
+  }
+  l->held = 0;
+  l->held_last = &l->held;
+}
+
+void trace_reset(trace_log *l) {
+  trace_deliver(l);
+  free(l->ring);
+  memset(l, 0, sizeof(trace_log));
+  l->held_last = &l->held;
+}
+
+int instance_reentered(pylibcb_instance *context) {
+  if (!context->in_callback)
+    return 0;
+
+  PyErr_SetString(Failure, "cannot run the event loop from inside a completion callback");
+  context->exception = 1;
+  return 1;
+}
+
+void instance_wait(pylibcb_instance *context) {
+  if (instance_reentered(context))
+    return;
+
+  trace_flush(&context->trace);
+  context->waiting = 1;
+  context->owner = PyThreadState_GET();
+  context->thread_state = PyEval_SaveThread();
+  /* libcouchbase has nothing in flight for requests waiting to be retried */
+  if (context->retry.waiting)
+    event_base_loop(context->base, EVLOOP_ONCE);
+  else
+    libcouchbase_wait(context->cb);
+  PyEval_RestoreThread(context->thread_state);
+  context->thread_state = 0;
+  context->waiting = 0;
+  if (context->trace.held)
+    trace_deliver(&context->trace);
+}
+
+void instance_loop_once(pylibcb_instance *context) {
+  if (instance_reentered(context))
+    return;
+
+  trace_flush(&context->trace);
+  context->waiting = 1;
+  context->owner = PyThreadState_GET();
+  context->thread_state = PyEval_SaveThread();
+  event_base_loop(context->base, EVLOOP_ONCE);
+  PyEval_RestoreThread(context->thread_state);
+  context->thread_state = 0;
+  context->waiting = 0;
+  if (context->trace.held)
+    trace_deliver(&context->trace);
 }
 
-int create_timeout(unsigned int usec, int *_ticket) {
-  event_list *timeout = alloc_event();
-  if (!timeout) {
-    PyErr_SetString(OutOfMemory, "failed to allocate timeout event");
+/* with a fixed limit a full window refuses new requests, an adaptive one
+   runs the event loop until enough of them complete */
+int async_backpressure(pylibcb_instance *context, int n) {
+  if (context->async_count + n <= context->async_limit)
     return 0;
+
+  if (!context->adaptive.enabled) {
+    PyErr_SetString(AsyncLimit, "async limit reached");
+    return -1;
+  }
+
+  while (context->async_count && context->async_count + n > context->async_limit) {
+    instance_loop_once(context);
+    if (context->internal_exception || context->exception)
+      return -1;
+  } return 0;
+}
+
+void release_timeout_event(ticket *t) {
+  if (t->timer_set) {
+    event_del(&t->timer);
+    t->timer_set = 0;
   }
+}
+
+void timeout_callback(libcouchbase_socket_t sock, short which, void *cb_data) {
+  pylibcb_instance *context = ((ticket *) cb_data)->instance;
+  CALLBACK_ENTER(context);
+
+  /* the waiter holds its own reference and checks the ticket, callbacks
+     queueing requests meanwhile take newer tickets */
+  release_timeout_event((ticket *) cb_data);
+  ((ticket *) cb_data)->expired = 1;
+  event_base_loopbreak(context->base);
+  rip_ticket((int *) cb_data);
+
+  CALLBACK_EXIT(context);
+}
 
+int create_timeout(pylibcb_instance *context, unsigned int usec, int *_ticket) {
+  ticket *t = (ticket *) _ticket;
   struct timeval tmo;
-  event_assign(&timeout->ev, context->base, -1, EV_TIMEOUT, timeout_callback, _ticket);
+
+  event_assign(&t->timer, context->base, -1, EV_TIMEOUT, timeout_callback, _ticket);
   tmo.tv_sec = usec / 1000000;
   tmo.tv_usec = usec % 1000000;
-  event_add(&timeout->ev, &tmo);
-  ((ticket *) _ticket)->ev = timeout;
+  event_add(&t->timer, &tmo);
+  t->timer_set = 1;
   return 1;
 }
 
-static char *default_error_string = "internal exception";
-static PyObject *default_exception;
+int wait_expired(int *_ticket) {
+  return _ticket && ((ticket *) _ticket)->expired;
+}
+
+void cancel_timeout(int *_ticket) {
+  ticket *t = (ticket *) _ticket;
+  if (!t->timer_set)
+    return;
+
+  /* the pending timer holds a reference to the ticket */
+  release_timeout_event(t);
+  rip_ticket(_ticket);
+}
+
+unsigned long long wheel_clock() {
+  return clock_usec() / 1000;
+}
+
+void wheel_link(timer_wheel *w, ticket *t) {
+  ticket **slot = &w->slots[t->deadline & WHEEL_MASK];
+
+  t->wheel_next = *slot;
+  if (*slot)
+    (*slot)->wheel_link = &t->wheel_next;
+  t->wheel_link = slot;
+  *slot = t;
+}
+
+void wheel_unlink(ticket *t) {
+  *t->wheel_link = t->wheel_next;
+  if (t->wheel_next)
+    t->wheel_next->wheel_link = t->wheel_link;
+  t->wheel_next = 0;
+  t->wheel_link = 0;
+}
+
+void wheel_arm(pylibcb_instance *context, unsigned long long tick) {
+  unsigned long long now = wheel_clock(), ms = tick > now ? tick - now : 0;
+  struct timeval tmo;
+
+  tmo.tv_sec = ms / 1000;
+  tmo.tv_usec = (ms % 1000) * 1000;
+  context->wheel.next = tick;
+  event_add(&context->wheel.ev, &tmo);
+}
+
+/* the wheel holds a reference to the ticket until the operation completes
+   or its deadline passes */
+void wheel_add(pylibcb_instance *context, int *_ticket, unsigned int usec) {
+  timer_wheel *w = &context->wheel;
+  ticket *t = (ticket *) _ticket;
+  unsigned long long now;
+
+  if (!usec)
+    return;
+
+  now = wheel_clock();
+  if (!w->count)
+    w->now = now;
+
+  t->deadline = now + (usec + 999) / 1000;
+  wheel_link(w, t);
+  hand_out_ticket(_ticket);
+  ++w->count;
+
+  if (!w->next || t->deadline < w->next)
+    wheel_arm(context, t->deadline);
+}
+
+void wheel_cancel(ticket *t) {
+  if (!t->wheel_link)
+    return;
+
+  wheel_unlink(t);
+  --t->instance->wheel.count;
+  rip_ticket((int *) t);
+}
+
+/* seconds until the wheel timer fires, or -1 if it is disarmed */
+double wheel_next_timeout(pylibcb_instance *context) {
+  unsigned long long now;
+
+  if (!context->wheel.next)
+    return -1;
+
+  now = wheel_clock();
+  return context->wheel.next > now ? (context->wheel.next - now) / 1e3 : 0;
+}
+
+int histogram_bucket(unsigned long long v) {
+  int e;
+
+  if (v < HIST_SUB)
+    return v;
+  if (v >> 32)
+    return HIST_BUCKETS - 1;
+
+  e = 31 - __builtin_clz((unsigned int) v);
+  return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* highest value that falls into a bucket */
+unsigned long long histogram_value(int bucket) {
+  int e;
+
+  if (bucket < HIST_SUB)
+    return bucket;
+
+  e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  return ((unsigned long long) (HIST_SUB + (bucket & (HIST_SUB - 1)) + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void histogram_add(histogram *h, unsigned long long v) {
+  if (!h->count || v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+  ++h->count;
+  h->sum += v;
+  ++h->buckets[histogram_bucket(v)];
+}
+
+unsigned long long histogram_percentile(histogram *h, double p) {
+  unsigned long long seen = 0, rank;
+  int i;
 
-PyObject *get_async_results() {
-  if (begin_async_results())
+  if (!h->count)
     return 0;
-  if (process_async_results(&context->async, process_async_result))
+
+  rank = (unsigned long long) (p / 100 * h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  for (i = 0; i < HIST_BUCKETS; ++i)
+    if ((seen += h->buckets[i]) >= rank)
+      break;
+
+  unsigned long long v = histogram_value(i);
+  return v > h->max ? h->max : v < h->min ? h->min : v;
+}
+
+void mark_op(int *_ticket, int op) {
+  ((ticket *) _ticket)->op = op;
+  ((ticket *) _ticket)->start = clock_usec();
+}
+
+void start_op(pylibcb_instance *context, int *_ticket, int op,
+	      const void *key, libcouchbase_size_t nkey, Py_ssize_t sent) {
+  ticket *t = (ticket *) _ticket;
+
+  mark_op(_ticket, op);
+  ++context->stats.ops[op];
+  context->stats.bytes_sent += sent;
+  if (context->trace.ring) {
+    t->traced_op = op;
+    t->flush_gen = context->trace.gen;
+    t->size = sent;
+    t->called = 0;
+    t->nkey = nkey;
+    memcpy(t->key, key, nkey < TRACE_KEY ? nkey : TRACE_KEY);
+    context->trace.unflushed = 1;
+  }
+}
+
+double wall_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void aimd_record(aimd *a, int from, const char *reason) {
+  aimd_event *e = &a->history[a->history_next++ % AIMD_HISTORY];
+  e->time = wall_clock();
+  e->from = from;
+  e->to = a->window;
+  e->reason = reason;
+}
+
+void aimd_cut(pylibcb_instance *context, const char *reason) {
+  aimd *a = &context->adaptive;
+  int from = a->window;
+
+  if (!a->enabled || a->cut)
+    return;
+
+  a->window = a->window / 2 < a->min ? a->min : a->window / 2;
+  a->cut = 1;
+  ++a->decreases;
+  aimd_record(a, from, reason);
+  context->async_limit = a->window;
+}
+
+void aimd_epoch(pylibcb_instance *context) {
+  aimd *a = &context->adaptive;
+  unsigned long long p99 = histogram_percentile(&a->epoch, 99);
+
+  if (a->baseline && p99 > a->baseline * AIMD_LATENCY_FACTOR)
+    aimd_cut(context, "latency");
+  else if ((int) a->window > a->epoch_window) {
+    ++a->increases;
+    aimd_record(a, a->epoch_window, "stable");
+  }
+
+  /* the baseline follows lasting latency changes, slowly */
+  a->baseline = a->baseline ? (a->baseline * 7 + p99) / 8 : p99;
+  memset(&a->epoch, 0, sizeof(histogram));
+  a->epoch_window = a->window;
+  a->cut = 0;
+}
+
+void aimd_complete(pylibcb_instance *context, unsigned long long usec) {
+  aimd *a = &context->adaptive;
+
+  histogram_add(&a->epoch, usec);
+  if (!a->cut) {
+    a->window += 1 / a->window;
+    if (a->window > a->max)
+      a->window = a->max;
+    context->async_limit = a->window;
+  }
+
+  if (a->epoch.count >= (a->window < AIMD_MIN_EPOCH ? AIMD_MIN_EPOCH : a->window))
+    aimd_epoch(context);
+}
+
+/* called from finish_op for a single-key op, inside its libcouchbase
+   callback or when it expires */
+void trace_finish(trace_log *l, ticket *t, unsigned long long now) {
+  /* submitted before the trace was enabled, or no longer pending */
+  if (t->traced_op == OP_NONE || (!l->called && !t->expired))
+    return;
+
+  t->called = l->called;
+  if (t->op == OP_GET || t->op == OP_GAT)
+    t->size = l->called ? (Py_ssize_t) l->received : 0;
+
+  if (t->instance->async_mode) {
+    trace_commit(l, t, now);
+    return;
+  }
+  t->held_next = 0;
+  *l->held_last = (ticket *) hand_out_ticket((int *) t);
+  l->held_last = &t->held_next;
+}
+
+/* records the latency once, late responses to expired ops are not counted.
+   a batch is one sample of the batch histogram */
+void finish_op(ticket *t) {
+  if (t->op == OP_NONE)
+    return;
+
+  unsigned long long now = clock_usec(), usec = now - t->start;
+  if (t->instance->trace.ring && !t->multi && !t->bulk)
+    trace_finish(&t->instance->trace, t, now);
+  if (t->multi || t->bulk)
+    histogram_add(&t->instance->stats.batches[t->op], usec);
+  else
+    histogram_add(&t->instance->stats.latency[t->op], usec);
+  /* only async requests count against the window */
+  if (t->instance->adaptive.enabled && t->async && !t->expired)
+    aimd_complete(t->instance, usec);
+  t->op = OP_NONE;
+}
+
+void complete_op(ticket *t) {
+  finish_op(t);
+  wheel_cancel(t);
+}
+
+PyObject *get_async_results(pylibcb_instance *context, int limit) {
+  int pending = context->async.count, n = pending;
+  if (limit >= 0 && limit < n)
+    n = limit;
+
+  PyObject *rval = PyList_New(n);
+  if (!rval)
     return 0;
-  return _async_rval;
+
+  if (process_async_results(&context->async, process_async_result, rval, n)) {
+    /* hand out what was collected, the rest stays buffered */
+    PyErr_Clear();
+    PyList_SetSlice(rval, pending - context->async.count, n, 0);
+  }
+  return rval;
 }
 
 void *error_callback(libcouchbase_t instance,
 		     libcouchbase_error_t error,
 		     const char *errinfo) {
-  /* just in case libcouchbase_error_handler starts giving us this */
-  if (error == LIBCOUCHBASE_SUCCESS)
+  pylibcb_instance *context = (pylibcb_instance *) libcouchbase_get_cookie(instance);
+
+  /* just in case libcouchbase_error_handler starts giving us this, and
+     with an I/O thread failures reach the waiters through their ops */
+  if (error == LIBCOUCHBASE_SUCCESS || context->io.running)
     return 0;
 
-  PyErr_SetString(default_exception, errinfo ? errinfo : default_error_string);
+  CALLBACK_ENTER(context);
+  PyErr_SetString(context->error_exception, errinfo ? errinfo : context->error_string);
   context->internal_error = error;
   context->internal_exception = 1;
   event_base_loopbreak(context->base);
+  CALLBACK_EXIT(context);
   return 0;
 }
 
@@ -367,9 +1462,9 @@ void *error_callback(libcouchbase_t instance,
 
 #define lcb_fail(code) lcb_code(code, Failure)
 
-PyObject *lcb_error(libcouchbase_error_t err, int context_error) {
+PyObject *lcb_error_type(libcouchbase_error_t err, char **msg) {
   PyObject *e_type = Failure;
-  char *e_msg = "unknown error passed to lcb_error";
+  char *e_msg = 0;
 
   switch (err) {
     lcb_fail(LIBCOUCHBASE_SUCCESS);
@@ -385,7 +1480,7 @@ PyObject *lcb_error(libcouchbase_error_t err, int context_error) {
     lcb_fail(LIBCOUCHBASE_ERROR);
     lcb_fail(LIBCOUCHBASE_ETMPFAIL);
     lcb_code(LIBCOUCHBASE_KEY_EEXISTS, KeyExists);
-    lcb_fail(LIBCOUCHBASE_KEY_ENOENT);
+    lcb_code(LIBCOUCHBASE_KEY_ENOENT, NotFound);
     lcb_fail(LIBCOUCHBASE_LIBEVENT_ERROR);
     lcb_code(LIBCOUCHBASE_NETWORK_ERROR, ConnectionFailure);
     lcb_fail(LIBCOUCHBASE_NOT_MY_VBUCKET);
@@ -398,514 +1493,4556 @@ PyObject *lcb_error(libcouchbase_error_t err, int context_error) {
     lcb_code(LIBCOUCHBASE_CONNECT_ERROR, ConnectionFailure);
   }
 
+  *msg = e_msg;
+  return e_type;
+}
+
+PyObject *lcb_error(pylibcb_instance *context, libcouchbase_error_t err, int context_error) {
+  char *e_msg;
+  PyObject *e_type = lcb_error_type(err, &e_msg);
+
+  if (!e_msg)
+    e_msg = "unknown error passed to lcb_error";
+  ++context->stats.errors[(unsigned) err < ERROR_SLOTS ? err : ERROR_SLOTS - 1];
+  if (err == LIBCOUCHBASE_ETMPFAIL || err == LIBCOUCHBASE_EBUSY)
+    aimd_cut(context, "tmpfail");
+
   if (context_error)
     CB_EXCEPTION(e_type, e_msg);
   NEW_EXCEPTION(e_type, e_msg);
 }
 
 
-void *get_callback(libcouchbase_t instance,
-		   const void *cookie,
-		   libcouchbase_error_t error,
-		   const void *key,
-		   libcouchbase_size_t nkey,
-		   const void *bytes,
-		   libcouchbase_size_t nbytes,
-		   libcouchbase_uint32_t flags,
-		   libcouchbase_cas_t cas) {
-  int t = rip_ticket((int *) cookie);
-  if (context->async_mode) {
-    PyObject *rval;
-    --context->async_count;
+/* transcoding between python objects and stored values. the format is
+   recorded in the low byte of the item flags so values are decoded with
+   the right codec instead of by trial and error */
 
-    switch (error) {
-    case LIBCOUCHBASE_SUCCESS:
-      rval = Py_BuildValue("(s#k)", bytes, nbytes, (unsigned long) cas);
-      break;
+#define FMT_JSON 0
+#define FMT_PICKLE 1
+#define FMT_BYTES 2
+#define FMT_UTF8 4
+#define FMT_AUTO -1
+#define FMT_MASK 0xff
+#define FMT_CUSTOM 8 /* first format number available to register_format */
 
-    case LIBCOUCHBASE_KEY_ENOENT:
-      Py_INCREF(Py_None);
-      rval = Py_None;
-      break;
-      
-    default:
-      rval = lcb_error(error, 0);
-    }
+static PyObject *json_dumps;
+static PyObject *json_loads;
+static PyObject *pickle_dumps;
+static PyObject *pickle_loads;
+
+PyObject *fetch_exception() {
+  PyObject *type, *value, *tb;
+
+  PyErr_Fetch(&type, &value, &tb);
+  PyErr_NormalizeException(&type, &value, &tb);
+  Py_XDECREF(type);
+  Py_XDECREF(tb);
+  return value;
+}
+
+PyObject *custom_codec(PyObject *formats, int format, int decode) {
+  PyObject *k, *c = 0;
+
+  if (formats && (k = PyInt_FromLong(format))) {
+    c = PyDict_GetItem(formats, k);
+    Py_DECREF(k);
+  }
 
-    async_push(&context->async, t, rval);
+  if (!c) {
+    PyErr_Format(Failure, "no %s registered for format %d", decode ? "decoder" : "encoder", format);
     return 0;
+  } return PyTuple_GET_ITEM(c, decode);
+}
+
+/* values above a size threshold can be compressed before they are
+   stored. the codec is recorded in flag bits above the format, and the
+   payload is the uncompressed length (4 bytes, big endian) followed by
+   the compressed data */
+
+#define COMPRESS_ZLIB 0x100
+#define COMPRESS_LZ4 0x200
+#define COMPRESS_MASK 0x300
+#define COMPRESS_HEADER 4
+#define COMPRESS_MAX_SIZE (256 << 20)
+
+#ifdef HAVE_LZ4
+#define COMPRESS_DEFAULT COMPRESS_LZ4
+#else
+#define COMPRESS_DEFAULT COMPRESS_ZLIB
+#endif
+
+PyObject *compress_bytes(int codec, const char *bytes, Py_ssize_t nbytes) {
+  unsigned long bound = codec == COMPRESS_ZLIB ? compressBound(nbytes) : 0;
+#ifdef HAVE_LZ4
+  if (codec == COMPRESS_LZ4)
+    bound = LZ4_compressBound(nbytes);
+#endif
+
+  PyObject *out = PyString_FromStringAndSize(0, COMPRESS_HEADER + bound);
+  if (!out)
+    return 0;
+
+  unsigned char *z = (unsigned char *) PyString_AS_STRING(out);
+  unsigned long nz = 0;
+  z[0] = nbytes >> 24;
+  z[1] = nbytes >> 16;
+  z[2] = nbytes >> 8;
+  z[3] = nbytes;
+
+  if (codec == COMPRESS_ZLIB) {
+    nz = bound;
+    if (compress2(z + COMPRESS_HEADER, &nz, (const unsigned char *) bytes, nbytes, Z_BEST_SPEED) != Z_OK)
+      nz = 0;
   }
+#ifdef HAVE_LZ4
+  if (codec == COMPRESS_LZ4) {
+    int n = LZ4_compress_default(bytes, (char *) z + COMPRESS_HEADER, nbytes, bound);
+    nz = n > 0 ? n : 0;
+  }
+#endif
 
-  if (t != context->callback_ticket)
+  if (!nz) {
+    Py_DECREF(out);
+    PyErr_SetString(Failure, "failed to compress value");
     return 0;
-  context->result = error;
+  }
 
-  switch (error) {
-  case LIBCOUCHBASE_SUCCESS:
-    break;
-  case LIBCOUCHBASE_KEY_ENOENT:
-    context->succeeded = 1;
+  if (_PyString_Resize(&out, COMPRESS_HEADER + nz))
     return 0;
+  return out;
+}
+
+/* the uncompressed length from the header, -1 with an exception set if
+   the value cannot be decompressed here */
+long compressed_length(const void *bytes, libcouchbase_size_t nbytes, libcouchbase_uint32_t flags) {
+  const unsigned char *z = bytes;
+  unsigned long n;
+
+  switch (flags & COMPRESS_MASK) {
+  case COMPRESS_ZLIB:
+#ifdef HAVE_LZ4
+  case COMPRESS_LZ4:
+#endif
+    break;
   default:
-    return lcb_error(error, 1);
+    PyErr_Format(Failure, "value compressed with unsupported codec (flags 0x%x)", flags);
+    return -1;
   }
-  
-  context->returned_value = Py_BuildValue("s#", bytes, nbytes);
-  context->returned_cas = cas;
-  context->succeeded = 1;
 
-  return 0;
+  if (nbytes < COMPRESS_HEADER
+      || (n = (unsigned long) z[0] << 24 | z[1] << 16 | z[2] << 8 | z[3]) > COMPRESS_MAX_SIZE) {
+    PyErr_SetString(Failure, "corrupt compressed value");
+    return -1;
+  } return n;
 }
 
-void *set_callback(libcouchbase_t instance,
-		   const void *cookie,
-		   libcouchbase_storage_t operation,
-		   libcouchbase_error_t error,
-		   const void *key,
-		   libcouchbase_size_t nkey,
-		   libcouchbase_cas_t cas) {
-  int t = rip_ticket((int *) cookie);
-  if (context->async_mode) {
-    PyObject *rval;
-    --context->async_count;
-    
-    switch(error) {
-    case LIBCOUCHBASE_SUCCESS:
-      Py_INCREF(Py_True);
-      rval = Py_True;
-      break;
-    default:
-      rval = lcb_error(error, 0);
-    }
+/* fills out with exactly n bytes, n as returned by compressed_length */
+int decompress_into(const void *bytes, libcouchbase_size_t nbytes, libcouchbase_uint32_t flags,
+		    char *out, unsigned long n) {
+  const unsigned char *z = bytes;
+  int ok = 0;
+
+  switch (flags & COMPRESS_MASK) {
+  case COMPRESS_ZLIB: {
+    unsigned long len = n;
+    ok = uncompress((unsigned char *) out, &len, z + COMPRESS_HEADER, nbytes - COMPRESS_HEADER) == Z_OK
+      && len == n;
+    break;
+  }
+#ifdef HAVE_LZ4
+  case COMPRESS_LZ4:
+    ok = LZ4_decompress_safe((const char *) z + COMPRESS_HEADER, out, nbytes - COMPRESS_HEADER, n) == (int) n;
+    break;
+#endif
+  }
+
+  if (!ok) {
+    PyErr_SetString(Failure, "corrupt compressed value");
+    return -1;
+  } return 0;
+}
 
-    async_push(&context->async, t, rval);
+PyObject *decompress_bytes(const void *bytes, libcouchbase_size_t nbytes, libcouchbase_uint32_t flags) {
+  long n = compressed_length(bytes, nbytes, flags);
+  if (n < 0)
     return 0;
-  }
 
-  if (t != context->callback_ticket)
+  PyObject *out = PyString_FromStringAndSize(0, n);
+  if (!out)
     return 0;
-  context->result = error;
 
-  switch (error) {
-  case LIBCOUCHBASE_SUCCESS:
+  if (decompress_into(bytes, nbytes, flags, PyString_AS_STRING(out), n)) {
+    Py_DECREF(out);
+    return 0;
+  } return out;
+}
+
+/* decodes a string holding the stored bytes, taking over its reference */
+PyObject *decode_string(PyObject *formats,
+			PyObject *raw,
+			libcouchbase_uint32_t flags) {
+  int format = flags & FMT_MASK;
+  PyObject *codec, *v;
+
+  switch (format) {
+  case FMT_BYTES:
+    return raw;
+  case FMT_UTF8:
+    v = PyUnicode_DecodeUTF8(PyString_AS_STRING(raw), PyString_GET_SIZE(raw), "strict");
+    Py_DECREF(raw);
+    return v;
+  case FMT_JSON:
+    codec = json_loads;
+    break;
+  case FMT_PICKLE:
+    codec = pickle_loads;
     break;
   default:
-    return lcb_error(error, 1);
+    codec = custom_codec(formats, format, 1);
+    if (!codec) {
+      Py_DECREF(raw);
+      return 0;
+    }
+  }
+
+  v = PyObject_CallFunctionObjArgs(codec, raw, NULL);
+
+  /* flags 0 carries no format tag: the item may be legacy or foreign data
+     that is not json, which comes back as stored. json this client writes
+     has flags 0 too but decodes cleanly; items with any flag set never fall
+     back */
+  if (!v && !flags && PyErr_ExceptionMatches(PyExc_ValueError)) {
+    PyErr_Clear();
+    return raw;
+  }
+
+  Py_DECREF(raw);
+  return v;
+}
+
+PyObject *decode_bytes(PyObject *formats,
+		       const void *bytes,
+		       libcouchbase_size_t nbytes,
+		       libcouchbase_uint32_t flags) {
+  PyObject *raw;
+
+  if (flags & COMPRESS_MASK)
+    raw = decompress_bytes(bytes, nbytes, flags);
+  else if ((flags & FMT_MASK) == FMT_UTF8)
+    return PyUnicode_DecodeUTF8(bytes, nbytes, "strict");
+  else
+    raw = PyString_FromStringAndSize(bytes, nbytes);
+
+  if (!raw)
+    return 0;
+  return decode_string(formats, raw, flags);
+}
+
+PyObject *decode_value(pylibcb_instance *context,
+		       const void *bytes,
+		       libcouchbase_size_t nbytes,
+		       libcouchbase_uint32_t flags) {
+  if (flags & COMPRESS_MASK) {
+    unsigned long long start = clock_usec();
+    PyObject *raw = decompress_bytes(bytes, nbytes, flags);
+    context->stats.decompress_usec += clock_usec() - start;
+    ++context->stats.decompressed;
+
+    if (!raw || !context->transcoding)
+      return raw;
+    return decode_string(context->formats, raw, flags);
   }
 
+  if (!context->transcoding)
+    return PyString_FromStringAndSize(bytes, nbytes);
+  return decode_bytes(context->formats, bytes, nbytes, flags);
+}
+
+/* replaces the encoded value if compressing it saves space */
+int compress_value(pylibcb_instance *context,
+		   PyObject **encoded,
+		   libcouchbase_uint32_t *flags) {
+  Py_ssize_t n = PyString_GET_SIZE(*encoded);
+
+  if (!context->compression || n < context->compress_threshold)
+    return 0;
+
+  unsigned long long start = clock_usec();
+  PyObject *z = compress_bytes(context->compression, PyString_AS_STRING(*encoded), n);
+  context->stats.compress_usec += clock_usec() - start;
+  if (!z) {
+    Py_DECREF(*encoded);
+    return -1;
+  }
+
+  if (PyString_GET_SIZE(z) >= n) {
+    ++context->stats.compress_skipped;
+    Py_DECREF(z);
+    return 0;
+  }
+
+  ++context->stats.compressed;
+  context->stats.compress_in += n;
+  context->stats.compress_out += PyString_GET_SIZE(z);
+  Py_DECREF(*encoded);
+  *encoded = z;
+  *flags |= context->compression;
   return 0;
 }
 
-void *remove_callback(libcouchbase_t instance,
-		      const void *cookie,
-		      libcouchbase_error_t error,
-		      const void *key,
-		      libcouchbase_size_t nkey) {
-  int t = rip_ticket((int *) cookie);
-  if (context->async_mode) {
-    PyObject *rval;
-    --context->async_count;
-    
-    switch (error) {
-    case LIBCOUCHBASE_SUCCESS:
-      Py_INCREF(Py_True);
-      rval = Py_True;
-      break;
-    default:
-      rval = lcb_error(error, 0);
+int encode_value(pylibcb_instance *context,
+		 PyObject *value,
+		 int format,
+		 PyObject **encoded,
+		 libcouchbase_uint32_t *flags) {
+  if (!context->transcoding) {
+    if (!PyString_Check(value)) {
+      PyErr_SetString(PyExc_TypeError, "value must be a string when transcoding is disabled");
+      return -1;
     }
+    Py_INCREF(value);
+    *encoded = value;
+    *flags = 0;
+    if (compress_value(context, encoded, flags))
+      return -1;
+    /* flags 0 reads as json, which raw bytes are not; the compression
+       bits already tell readers the value is not a legacy one */
+    if (*flags & COMPRESS_MASK)
+      *flags |= FMT_BYTES;
+    return 0;
+  }
 
-    async_push(&context->async, t, rval);
-    return 0; 
+  if (format == FMT_AUTO) {
+    if (PyString_Check(value))
+      format = FMT_BYTES;
+    else if (PyUnicode_Check(value))
+      format = FMT_UTF8;
+    else if (value == Py_None || PyBool_Check(value) || PyInt_Check(value) || PyLong_Check(value)
+	     || PyFloat_Check(value) || PyDict_Check(value) || PyList_Check(value) || PyTuple_Check(value))
+      format = FMT_JSON;
+    else
+      format = FMT_PICKLE;
+  } else if (format < 0 || format > FMT_MASK) {
+    PyErr_Format(Failure, "invalid format %d", format);
+    return -1;
   }
 
-  if (t != context->callback_ticket)
-    return 0;
-  context->result = error;
+  PyObject *codec;
+  *encoded = 0;
 
-  switch (error) {
-  case LIBCOUCHBASE_SUCCESS:
+  switch (format) {
+  case FMT_BYTES:
+    if (PyString_Check(value)) {
+      Py_INCREF(value);
+      *encoded = value;
+    } else
+      PyErr_SetString(PyExc_TypeError, "FMT_BYTES value must be a string");
+    break;
+  case FMT_UTF8:
+    if (PyUnicode_Check(value))
+      *encoded = PyUnicode_AsUTF8String(value);
+    else if (PyString_Check(value)) {
+      Py_INCREF(value);
+      *encoded = value;
+    } else
+      PyErr_SetString(PyExc_TypeError, "FMT_UTF8 value must be a unicode string");
+    break;
+  case FMT_JSON:
+    *encoded = PyObject_CallFunctionObjArgs(json_dumps, value, NULL);
+    break;
+  case FMT_PICKLE:
+    *encoded = PyObject_CallFunction(pickle_dumps, "Oi", value, -1);
     break;
   default:
-    return lcb_error(error, 1);
-  }  
+    codec = custom_codec(context->formats, format, 0);
+    if (codec)
+      *encoded = PyObject_CallFunctionObjArgs(codec, value, NULL);
+  }
+
+  if (!*encoded)
+    return -1;
+
+  if (!PyString_Check(*encoded)) {
+    Py_DECREF(*encoded);
+    PyErr_Format(PyExc_TypeError, "encoder for format %d must return a string", format);
+    return -1;
+  }
+
+  *flags = format;
+  return compress_value(context, encoded, flags);
+}
+
+/* buffer values hold the received bytes in the same allocation as the
+   object and expose them through the buffer protocol, so callers that
+   only pass values on never build an intermediate string or decode them.
+   compressed values are decompressed into that storage, their flags keep
+   only the format */
+
+typedef struct t_pylibcb_value {
+  PyObject_VAR_HEAD
+  PyObject *formats;
+  unsigned int flags;
+  unsigned PY_LONG_LONG cas;
+  char data[1];
+} pylibcb_value;
+
+static PyTypeObject ValueType;
+
+PyObject *new_value(pylibcb_instance *context,
+		    const void *bytes,
+		    libcouchbase_size_t nbytes,
+		    libcouchbase_uint32_t flags,
+		    libcouchbase_cas_t cas) {
+  long n = nbytes;
+
+  if (flags & COMPRESS_MASK && (n = compressed_length(bytes, nbytes, flags)) < 0)
+    return 0;
+
+  pylibcb_value *v = PyObject_NewVar(pylibcb_value, &ValueType, n);
+  if (!v)
+    return 0;
+
+  if (flags & COMPRESS_MASK) {
+    unsigned long long start = clock_usec();
+    int failed = decompress_into(bytes, nbytes, flags, v->data, n);
+    context->stats.decompress_usec += clock_usec() - start;
+    ++context->stats.decompressed;
+    if (failed) {
+      v->formats = 0;
+      Py_DECREF(v);
+      return 0;
+    }
+    flags &= ~COMPRESS_MASK;
+  } else
+    memcpy(v->data, bytes, nbytes);
+  v->data[n] = 0;
+  v->flags = flags;
+  v->cas = cas;
+  v->formats = context->formats;
+  Py_XINCREF(v->formats);
+
+  /* the decoded path copies into a string before handing it to a codec */
+  if (context->transcoding && (flags & FMT_MASK) != FMT_BYTES)
+    context->copy_avoided_bytes += n;
+
+  return (PyObject *) v;
+}
+
+void value_dealloc(PyObject *self) {
+  Py_XDECREF(((pylibcb_value *) self)->formats);
+  PyObject_Del(self);
+}
+
+Py_ssize_t value_length(PyObject *self) {
+  return Py_SIZE(self);
+}
+
+PyObject *value_str(PyObject *self) {
+  return PyString_FromStringAndSize(((pylibcb_value *) self)->data, Py_SIZE(self));
+}
 
+Py_ssize_t value_getreadbuffer(PyObject *self, Py_ssize_t segment, void **ptr) {
+  if (segment) {
+    PyErr_SetString(PyExc_SystemError, "accessing non-existent value segment");
+    return -1;
+  }
+
+  *ptr = ((pylibcb_value *) self)->data;
+  return Py_SIZE(self);
+}
+
+Py_ssize_t value_getsegcount(PyObject *self, Py_ssize_t *lenp) {
+  if (lenp)
+    *lenp = Py_SIZE(self);
+  return 1;
+}
+
+int value_getbuffer(PyObject *self, Py_buffer *view, int flags) {
+  return PyBuffer_FillInfo(view, self, ((pylibcb_value *) self)->data, Py_SIZE(self), 1, flags);
+}
+
+PyObject *value_decode(PyObject *self, PyObject *args) {
+  pylibcb_value *v = (pylibcb_value *) self;
+  return decode_bytes(v->formats, v->data, Py_SIZE(v), v->flags);
+}
+
+static PySequenceMethods value_as_sequence = {
+  value_length,
+};
+
+static PyBufferProcs value_as_buffer = {
+  value_getreadbuffer,
+  0,
+  value_getsegcount,
+  (charbufferproc) value_getreadbuffer,
+  value_getbuffer,
+  0,
+};
+
+static PyMemberDef value_members[] = {
+  { "flags", T_UINT, offsetof(pylibcb_value, flags), READONLY,
+    "item flags, without the compression bits of a decompressed value" },
+  { "cas", T_ULONGLONG, offsetof(pylibcb_value, cas), READONLY,
+    "CAS value" },
+  { 0 }
+};
+
+static PyMethodDef value_methods[] = {
+  { "decode", value_decode, METH_NOARGS,
+    "Decode the value according to the format in its flags" },
+  { 0, 0, 0, 0 }
+};
+
+static PyTypeObject ValueType = {
+  PyObject_HEAD_INIT(0)
+  0,
+  "_pylibcb.Value",
+  offsetof(pylibcb_value, data) + 1,
+  1,
+  value_dealloc,
+};
+
+PyObject *deliver_value(pylibcb_instance *context,
+			const void *bytes,
+			libcouchbase_size_t nbytes,
+			libcouchbase_uint32_t flags,
+			libcouchbase_cas_t cas) {
+  if (context->buffer_values)
+    return new_value(context, bytes, nbytes, flags, cas);
+  return decode_value(context, bytes, nbytes, flags);
+}
+
+unsigned int near_hash(const void *key, libcouchbase_size_t nkey) {
+  const unsigned char *k = key;
+  unsigned int h = 2166136261u;
+
+  while (nkey--)
+    h = (h ^ *k++) * 16777619u;
+  return h;
+}
+
+near_entry *near_find(near_cache *c, const void *key, libcouchbase_size_t nkey, unsigned int hash) {
+  near_entry *e;
+
+  for (e = c->buckets[hash & c->mask]; e; e = e->chain)
+    if (e->hash == hash && e->nkey == nkey && !memcmp(e->key, key, nkey))
+      return e;
   return 0;
 }
 
-static PyObject *open(PyObject *self, PyObject *args) {
-  char *host = 0;
-  char *user = 0;
-  char *passwd = 0;
-  char *bucket = 0;
+void near_unlink(near_cache *c, near_entry *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    c->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    c->tail = e->prev;
+}
+
+void near_push(near_cache *c, near_entry *e) {
+  e->prev = 0;
+  e->next = c->head;
+  if (c->head)
+    c->head->prev = e;
+  else
+    c->tail = e;
+  c->head = e;
+}
+
+void near_drop(near_cache *c, near_entry *e) {
+  near_entry **p = &c->buckets[e->hash & c->mask];
+
+  while (*p != e)
+    p = &(*p)->chain;
+  *p = e->chain;
+  near_unlink(c, e);
+
+  --c->entries;
+  c->bytes -= e->size;
+  Py_DECREF(e->bytes);
+  free(e);
+}
+
+/* a write drops the entry for its key, unless the entry already holds the
+   cas the write produced (0 for failed writes and removes) */
+void near_written(pylibcb_instance *context, const void *key, libcouchbase_size_t nkey, libcouchbase_cas_t cas) {
+  near_cache *c = &context->near;
+  near_entry *e;
+
+  if (!c->buckets || !(e = near_find(c, key, nkey, near_hash(key, nkey))))
+    return;
+  if (cas && e->cas == cas)
+    return;
+
+  near_drop(c, e);
+  ++context->stats.near_invalidations;
+}
+
+/* keeps a value read from the server; the cache is best effort, so
+   failing to allocate an entry is not an error */
+void near_store(pylibcb_instance *context,
+		const void *key,
+		libcouchbase_size_t nkey,
+		const void *bytes,
+		libcouchbase_size_t nbytes,
+		libcouchbase_uint32_t flags,
+		libcouchbase_cas_t cas) {
+  near_cache *c = &context->near;
+  unsigned int hash = near_hash(key, nkey);
+  Py_ssize_t size = sizeof(near_entry) + nkey + nbytes;
+  near_entry *e = near_find(c, key, nkey, hash);
+
+  if (e) {
+    if (e->cas == cas) {
+      e->expires = clock_usec() + c->ttl;
+      near_unlink(c, e);
+      near_push(c, e);
+      return;
+    }
+    near_drop(c, e);
+  }
+
+  if (size > c->max_bytes)
+    return;
+
+  e = malloc(sizeof(near_entry) + nkey);
+  if (!e)
+    return;
+  e->bytes = PyString_FromStringAndSize(bytes, nbytes);
+  if (!e->bytes) {
+    PyErr_Clear();
+    free(e);
+    return;
+  }
+
+  memcpy(e->key, key, nkey);
+  e->nkey = nkey;
+  e->hash = hash;
+  e->flags = flags;
+  e->cas = cas;
+  e->size = size;
+  e->expires = clock_usec() + c->ttl;
+  e->chain = c->buckets[hash & c->mask];
+  c->buckets[hash & c->mask] = e;
+  near_push(c, e);
+  ++c->entries;
+  c->bytes += size;
+
+  while (c->entries > c->max_entries || c->bytes > c->max_bytes) {
+    near_drop(c, c->tail);
+    ++context->stats.near_evictions;
+  }
+}
+
+/* the get in flight for a key, 0 if there is none */
+inflight *coalesce_find(coalescer *c, const void *key, libcouchbase_size_t nkey, unsigned int hash) {
+  inflight *e;
+
+  if (!c->buckets)
+    return 0;
+  for (e = c->buckets[hash & c->mask]; e; e = e->chain)
+    if (e->hash == hash && e->nkey == nkey && !memcmp(e->key, key, nkey))
+      return e;
+  return 0;
+}
+
+int coalesce_grow(coalescer *c) {
+  unsigned int size = c->buckets ? (c->mask + 1) * 2 : COALESCE_MIN_BUCKETS, i;
+  inflight **buckets = calloc(size, sizeof(inflight *)), *e, *n;
+
+  if (!buckets)
+    return 0;
+  if (c->buckets)
+    for (i = 0; i <= c->mask; ++i)
+      for (e = c->buckets[i]; e; e = n) {
+	n = e->chain;
+	e->chain = buckets[e->hash & (size - 1)];
+	buckets[e->hash & (size - 1)] = e;
+      }
+  free(c->buckets);
+  c->buckets = buckets;
+  c->mask = size - 1;
+  return 1;
+}
+
+/* best effort, a get that cannot be registered just takes no joiners */
+void coalesce_add(coalescer *c, ticket *t, const void *key, libcouchbase_size_t nkey, unsigned int hash) {
+  if ((!c->buckets || c->entries > (int) c->mask) && !coalesce_grow(c))
+    return;
+
+  inflight *e = malloc(sizeof(inflight) + nkey);
+  if (!e)
+    return;
+
+  e->leader = t;
+  e->hash = hash;
+  e->nkey = nkey;
+  memcpy(e->key, key, nkey);
+  e->chain = c->buckets[hash & c->mask];
+  c->buckets[hash & c->mask] = e;
+  ++c->entries;
+  t->inflight = e;
+}
+
+void coalesce_written(pylibcb_instance *context, const void *key, libcouchbase_size_t nkey) {
+  coalescer *c = &context->coalesce;
+  inflight *e;
+
+  if (c->entries && (e = coalesce_find(c, key, nkey, near_hash(key, nkey))))
+    coalesce_drop(c, e);
+}
+
+/* returns 1 and a new reference to the value on a hit, 0 on a miss and -1
+   if decoding the cached bytes failed */
+int near_lookup(pylibcb_instance *context,
+		const void *key,
+		libcouchbase_size_t nkey,
+		PyObject **value,
+		libcouchbase_cas_t *cas) {
+  near_cache *c = &context->near;
+  near_entry *e = near_find(c, key, nkey, near_hash(key, nkey));
+
+  if (e && e->expires <= clock_usec()) {
+    near_drop(c, e);
+    ++context->stats.near_expirations;
+    e = 0;
+  }
+
+  if (!e) {
+    ++context->stats.near_misses;
+    return 0;
+  }
+
+  ++context->stats.near_hits;
+  near_unlink(c, e);
+  near_push(c, e);
+  *cas = e->cas;
+
+  /* plain strings are immutable and can be shared with the caller */
+  if (!context->buffer_values && !(e->flags & COMPRESS_MASK)
+      && (!context->transcoding || (e->flags & FMT_MASK) == FMT_BYTES)) {
+    Py_INCREF(e->bytes);
+    *value = e->bytes;
+    return 1;
+  }
+
+  *value = deliver_value(context, PyString_AS_STRING(e->bytes), PyString_GET_SIZE(e->bytes), e->flags, e->cas);
+  return *value ? 1 : -1;
+}
+
+/* async results go to the operation's completion callback if it has one
+   and to the result buffer read by async_wait/async_poll otherwise */
+
+void async_deliver(pylibcb_instance *context, ticket *t, PyObject *value) {
+  if (!t->callback) {
+    if (async_push(&context->async, t->ticket[0], value)) {
+      Py_DECREF(value);
+      if (!context->callback_error[0])
+	/* raised from the next async_wait or async_poll */
+	PyErr_Fetch(&context->callback_error[0], &context->callback_error[1], &context->callback_error[2]);
+      else
+	PyErr_Clear();
+    }
+    return;
+  }
+
+  context->in_callback = 1;
+  PyObject *r = PyObject_CallFunction(t->callback, "iO", t->ticket[0], value);
+  context->in_callback = 0;
+  Py_DECREF(value);
+
+  if (r)
+    Py_DECREF(r);
+  else if (!context->callback_error[0])
+    /* raised from the next async_wait or async_poll */
+    PyErr_Fetch(&context->callback_error[0], &context->callback_error[1], &context->callback_error[2]);
+  else
+    PyErr_Clear();
+}
+
+int raise_callback_error(pylibcb_instance *context) {
+  if (!context->callback_error[0])
+    return 0;
+
+  PyErr_Restore(context->callback_error[0], context->callback_error[1], context->callback_error[2]);
+  context->callback_error[0] = context->callback_error[1] = context->callback_error[2] = 0;
+  return -1;
+}
+
+PyObject *timeout_exception() {
+  PyObject *e = PyObject_CallFunction(Timeout, "s", "operation deadline expired");
+  return e ? e : fetch_exception();
+}
+
+/* keys of a batch that have no result yet are reported as timed out */
+void timeout_missing_keys(ticket *t) {
+  Py_ssize_t i, n = PyTuple_GET_SIZE(t->keys);
+
+  for (i = 0; i < n; ++i) {
+    PyObject *k = PyTuple_GET_ITEM(t->keys, i);
+    if (PyDict_GetItem(t->multi, k))
+      continue;
+
+    PyObject *e = timeout_exception();
+    PyDict_SetItem(t->multi, k, e);
+    Py_DECREF(e);
+  }
+  PyErr_Clear();
+}
+
+/* an operation past its deadline completes with Timeout on its own ticket;
+   the response still owed by libcouchbase is dropped when it arrives */
+void expire_ticket(pylibcb_instance *context, ticket *t) {
+  t->expired = 1;
+  /* gets already joined still take the response if it comes */
+  if (t->inflight)
+    coalesce_drop(&context->coalesce, t->inflight);
+  ++context->stats.timeouts;
+  aimd_cut(context, "timeout");
+  finish_op(t);
+
+  if (t->multi) {
+    int outstanding = t->pending - t->submitting;
+
+    if (t->keys)
+      timeout_missing_keys(t);
+    t->pending = t->submitting;
+    if (context->async_mode) {
+      context->async_count -= outstanding;
+      if (!t->pending) {
+	Py_INCREF(t->multi);
+	async_deliver(context, t, t->multi);
+      }
+    }
+  } else if (context->async_mode) {
+    --context->async_count;
+    async_deliver(context, t, timeout_exception());
+  }
+
+  if (!context->async_mode) {
+    if (t->ticket[0] == context->callback_ticket) {
+      context->timed_out = 1;
+      event_base_loopbreak(context->base);
+    }
+  } else if (!context->async_count)
+    /* libcouchbase_wait would keep running for the dropped responses */
+    event_base_loopbreak(context->base);
+}
+
+void wheel_callback(libcouchbase_socket_t sock, short which, void *cb_data) {
+  pylibcb_instance *context = (pylibcb_instance *) cb_data;
+  timer_wheel *w = &context->wheel;
+  ticket *t, *n, *expired = 0;
+  unsigned long long tick, now;
+
+  CALLBACK_ENTER(context);
+
+  w->next = 0;
+  now = wheel_clock();
+  tick = now - w->now > WHEEL_SLOTS ? now - WHEEL_SLOTS : w->now;
+
+  /* unlink everything due first, completions may add new deadlines */
+  while (tick++ < now)
+    for (t = w->slots[tick & WHEEL_MASK]; t; t = n) {
+      n = t->wheel_next;
+      if (t->deadline > now)
+	continue;
+      wheel_unlink(t);
+      --w->count;
+      t->wheel_next = expired;
+      expired = t;
+    }
+  w->now = now;
+
+  while ((t = expired)) {
+    expired = t->wheel_next;
+    t->wheel_next = 0;
+    expire_ticket(context, t);
+    rip_ticket((int *) t);
+  }
+
+  /* wake up at the nearest occupied slot, which may only hold later turns */
+  if (w->count) {
+    for (tick = now + 1; !w->slots[tick & WHEEL_MASK]; ++tick)
+      ;
+    if (!w->next || tick < w->next)
+      wheel_arm(context, tick);
+  }
+
+  CALLBACK_EXIT(context);
+}
+
+/* every key sent through a ticket passes here */
+request *track_request(int *_ticket, int kind, const void *key, libcouchbase_size_t nkey) {
+  ticket *t = (ticket *) _ticket;
+
+  if (kind != OP_GET && kind != OP_GAT)
+    coalesce_written(t->instance, key, nkey);
+
+  if (t->instance->retry.attempts < 2)
+    return 0;
+
+  /* best effort, a request that cannot be kept is just not retried */
+  request *r = calloc(1, sizeof(request) + nkey);
+  if (!r)
+    return 0;
+
+  r->ticket = t;
+  r->kind = kind;
+  r->started = clock_usec();
+  r->nkey = nkey;
+  memcpy(r->key, key, nkey);
+  r->next = t->requests;
+  t->requests = r;
+  return r;
+}
+
+void track_key(int *_ticket, int kind, const void *key, libcouchbase_size_t nkey,
+	       libcouchbase_time_t expiry, libcouchbase_cas_t cas) {
+  request *r = track_request(_ticket, kind, key, nkey);
+  if (r) {
+    r->expiry = expiry;
+    r->cas = cas;
+  }
+}
+
+void track_store(int *_ticket, libcouchbase_storage_t operation, const void *key, libcouchbase_size_t nkey,
+		 PyObject *value, libcouchbase_uint32_t flags, libcouchbase_time_t expiry, libcouchbase_cas_t cas) {
+  request *r = track_request(_ticket, OP_SET, key, nkey);
+  if (r) {
+    r->operation = operation;
+    Py_INCREF(value);
+    r->value = value;
+    r->flags = flags;
+    r->expiry = expiry;
+    r->cas = cas;
+  }
+}
+
+void track_arithmetic(int *_ticket, const void *key, libcouchbase_size_t nkey, libcouchbase_int64_t delta,
+		      libcouchbase_time_t expiry, int create, libcouchbase_uint64_t initial) {
+  request *r = track_request(_ticket, OP_ARITHMETIC, key, nkey);
+  if (r) {
+    r->delta = delta;
+    r->expiry = expiry;
+    r->create = create;
+    r->initial = initial;
+  }
+}
+
+void submit_request(pylibcb_instance *context, request *r) {
+  const void *key = r->key;
+
+  switch (r->kind) {
+  case OP_GET:
+  case OP_GAT:
+    libcouchbase_mget_by_key(context->cb, r->ticket, 0, 0, 1, &key, &r->nkey, r->kind == OP_GAT ? &r->expiry : 0);
+    break;
+  case OP_SET:
+    libcouchbase_store_by_key(context->cb, r->ticket, r->operation, 0, 0, key, r->nkey,
+			      PyString_AS_STRING(r->value), PyString_GET_SIZE(r->value), r->flags, r->expiry, r->cas);
+    break;
+  case OP_REMOVE:
+    libcouchbase_remove_by_key(context->cb, r->ticket, 0, 0, key, r->nkey, r->cas);
+    break;
+  case OP_ARITHMETIC:
+    libcouchbase_arithmetic_by_key(context->cb, r->ticket, 0, 0, key, r->nkey, r->delta, r->expiry, r->create, r->initial);
+  }
+}
+
+void retry_callback(libcouchbase_socket_t sock, short which, void *cb_data) {
+  request *r = (request *) cb_data, **p;
+  ticket *t = r->ticket;
+  pylibcb_instance *context = t->instance;
+
+  CALLBACK_ENTER(context);
+
+  for (p = &context->retry.waiting; *p != r; p = &(*p)->retry_next)
+    ;
+  *p = r->retry_next;
+  r->retry_next = 0;
+
+  /* an expired ticket has completed without this request, unless other
+     gets joined it */
+  if (t->expired && !t->followers)
+    rip_ticket((int *) t);
+  else
+    submit_request(context, r);
+
+  CALLBACK_EXIT(context);
+}
+
+unsigned long long retry_backoff(retry_policy *p, int attempt) {
+  unsigned long long b = (unsigned long long) p->backoff << (attempt < 20 ? attempt : 20);
+  if (b > p->max_backoff)
+    b = p->max_backoff;
+
+  /* wait between half and all of it so clients failed together spread out */
+  p->seed ^= p->seed << 13;
+  p->seed ^= p->seed >> 7;
+  p->seed ^= p->seed << 17;
+  return b / 2 + p->seed % (b / 2 + 1);
+}
+
+/* returns 1 if a response carrying a transient error was scheduled to be
+   sent again, its reference to the ticket then stays with the retry */
+int retry_request(pylibcb_instance *context,
+		  ticket *t,
+		  libcouchbase_error_t error,
+		  const void *key,
+		  libcouchbase_size_t nkey) {
+  retry_policy *p = &context->retry;
+  request *r;
+
+  if (!t->requests || (error != LIBCOUCHBASE_ETMPFAIL && error != LIBCOUCHBASE_EBUSY
+		       && error != LIBCOUCHBASE_NOT_MY_VBUCKET))
+    return 0;
+
+  for (r = t->requests; r && (r->nkey != nkey || memcmp(r->key, key, nkey)); r = r->next)
+    ;
+  if (!r)
+    return 0;
+
+  unsigned long long now = clock_usec(), wait = retry_backoff(p, r->attempts);
+  if (r->attempts + 1 >= p->attempts || (p->deadline && now + wait > r->started + p->deadline)) {
+    ++context->stats.retries_exhausted;
+    return 0;
+  }
+
+  ++r->attempts;
+  ++context->stats.retries;
+  aimd_cut(context, "tmpfail");
+
+  struct timeval tv = { wait / 1000000, wait % 1000000 };
+  r->due = now + wait;
+  r->retry_next = p->waiting;
+  p->waiting = r;
+  event_assign(&r->ev, context->base, -1, 0, retry_callback, r);
+  event_add(&r->ev, &tv);
+  return 1;
+}
+
+double retry_next_timeout(pylibcb_instance *context) {
+  unsigned long long now, due = 0;
+  request *r;
+
+  for (r = context->retry.waiting; r; r = r->retry_next)
+    if (!due || r->due < due)
+      due = r->due;
+  if (!due)
+    return -1;
+
+  now = clock_usec();
+  return due > now ? (due - now) / 1e6 : 0;
+}
+
+void multi_result(ticket *_t,
+		  const void *key,
+		  libcouchbase_size_t nkey,
+		  PyObject *v) {
+  pylibcb_instance *context = _t->instance;
+  PyObject *k;
+
+  if (context->async_mode)
+    --context->async_count;
+
+  if (v) {
+    k = PyString_FromStringAndSize(key, nkey);
+    if (k) {
+      PyDict_SetItem(_t->multi, k, v);
+      Py_DECREF(k);
+    }
+    Py_DECREF(v);
+  }
+
+  /* the whole batch is delivered as a single (ticket, dict) result */
+  if (!--_t->pending) {
+    complete_op(_t);
+    if (context->async_mode) {
+      Py_INCREF(_t->multi);
+      async_deliver(context, _t, _t->multi);
+    }
+  }
+
+  rip_ticket((int *) _t);
+}
+
+void *multi_get_callback(ticket *_t,
+			 libcouchbase_error_t error,
+			 const void *key,
+			 libcouchbase_size_t nkey,
+			 const void *bytes,
+			 libcouchbase_size_t nbytes,
+			 libcouchbase_uint32_t flags,
+			 libcouchbase_cas_t cas) {
+  pylibcb_instance *context = _t->instance;
+  PyObject *v = 0;
+
+  switch (error) {
+  case LIBCOUCHBASE_SUCCESS:
+    v = deliver_value(context, bytes, nbytes, flags, cas);
+    if (!v)
+      v = fetch_exception();
+    else if (_t->return_cas)
+      v = Py_BuildValue("(Nk)", v, (unsigned long) cas);
+    break;
+
+  case LIBCOUCHBASE_KEY_ENOENT:
+    Py_INCREF(Py_None);
+    v = Py_None;
+    break;
+
+  default:
+    if (context->async_mode)
+      v = lcb_error(context, error, 0);
+    else if (_t->ticket[0] == context->callback_ticket && !context->exception)
+      lcb_error(context, error, 1);
+  }
+
+  multi_result(_t, key, nkey, v);
+  return 0;
+}
+
+void *multi_store_callback(ticket *_t,
+			   libcouchbase_error_t error,
+			   const void *key,
+			   libcouchbase_size_t nkey) {
+  PyObject *v;
+
+  /* failures are reported per key and never stop the batch */
+  if (error == LIBCOUCHBASE_SUCCESS) {
+    Py_INCREF(Py_True);
+    v = Py_True;
+  } else
+    v = lcb_error(_t->instance, error, 0);
+
+  multi_result(_t, key, nkey, v);
+  return 0;
+}
+
+void bulk_failure(ticket *_t,
+		  libcouchbase_error_t error,
+		  const void *key,
+		  libcouchbase_size_t nkey) {
+  bulk_job *b = _t->bulk;
+  PyObject *k, *v;
+
+  ++b->failed;
+  v = lcb_error(_t->instance, error, 0);
+  if (v && PyDict_Size(b->failures) < b->max_failures
+      && (k = PyString_FromStringAndSize(key, nkey))) {
+    PyDict_SetItem(b->failures, k, v);
+    Py_DECREF(k);
+  }
+  Py_XDECREF(v);
+  PyErr_Clear();
+}
+
+void bulk_done(ticket *_t) {
+  if (!--_t->pending)
+    complete_op(_t);
+  rip_ticket((int *) _t);
+}
+
+void bulk_result(ticket *_t,
+		 libcouchbase_error_t error,
+		 const void *key,
+		 libcouchbase_size_t nkey) {
+  if (error == LIBCOUCHBASE_SUCCESS)
+    ++_t->bulk->done;
+  else
+    bulk_failure(_t, error, key, nkey);
+  bulk_done(_t);
+}
+
+/* exported values are written as stored, each after a
+   key<TAB>flags<TAB>cas<TAB>length line and followed by a newline. missing
+   and failed keys go to the side file as key<TAB>reason lines */
+
+void bulk_write(bulk_job *b, FILE *f, const void *data, size_t n) {
+  if (!b->write_error && fwrite(data, 1, n, f) != n)
+    b->write_error = errno ? errno : EIO;
+}
+
+void bulk_reject(ticket *_t,
+		 libcouchbase_error_t error,
+		 const void *key,
+		 libcouchbase_size_t nkey) {
+  bulk_job *b = _t->bulk;
+  char *msg = "missing";
+
+  if (error == LIBCOUCHBASE_KEY_ENOENT)
+    ++b->missing;
+  else {
+    lcb_error_type(error, &msg);
+    bulk_failure(_t, error, key, nkey);
+  }
+
+  if (b->errors && !b->write_error
+      && fprintf(b->errors, "%.*s\t%s\n", (int) nkey, (const char *) key, msg ? msg : "error") < 0)
+    b->write_error = errno ? errno : EIO;
+}
+
+void bulk_export_result(ticket *_t,
+			libcouchbase_error_t error,
+			const void *key,
+			libcouchbase_size_t nkey,
+			const void *bytes,
+			libcouchbase_size_t nbytes,
+			libcouchbase_uint32_t flags,
+			libcouchbase_cas_t cas) {
+  bulk_job *b = _t->bulk;
+
+  if (error != LIBCOUCHBASE_SUCCESS)
+    bulk_reject(_t, error, key, nkey);
+  else {
+    ++b->done;
+    b->bytes += nbytes;
+    if (!b->write_error
+	&& fprintf(b->out, "%.*s\t%u\t%llu\t%lu\n", (int) nkey, (const char *) key,
+		   (unsigned) flags, (unsigned long long) cas, (unsigned long) nbytes) < 0)
+      b->write_error = errno ? errno : EIO;
+    bulk_write(b, b->out, bytes, nbytes);
+    bulk_write(b, b->out, "\n", 1);
+  }
+
+  bulk_done(_t);
+}
+
+/* the async result of a get: (value, cas), None if missing or an
+   exception instance */
+PyObject *get_result(pylibcb_instance *context,
+		     libcouchbase_error_t error,
+		     const void *bytes,
+		     libcouchbase_size_t nbytes,
+		     libcouchbase_uint32_t flags,
+		     libcouchbase_cas_t cas) {
+  PyObject *rval;
+
+  switch (error) {
+  case LIBCOUCHBASE_SUCCESS:
+    rval = deliver_value(context, bytes, nbytes, flags, cas);
+    if (!rval)
+      return fetch_exception();
+    return Py_BuildValue("(Nk)", rval, (unsigned long) cas);
+
+  case LIBCOUCHBASE_KEY_ENOENT:
+    Py_RETURN_NONE;
+
+  default:
+    return lcb_error(context, error, 0);
+  }
+}
+
+/* the response is decoded again for every get that joined, so callers
+   never share a mutable value */
+void coalesce_deliver(pylibcb_instance *context,
+		      ticket *t,
+		      libcouchbase_error_t error,
+		      const void *bytes,
+		      libcouchbase_size_t nbytes,
+		      libcouchbase_uint32_t flags,
+		      libcouchbase_cas_t cas) {
+  ticket *f = t->followers, *n;
+
+  for (t->followers = 0; f; f = n) {
+    n = f->follower_next;
+    f->follower_next = 0;
+    if (!f->expired) {
+      PyObject *rval = get_result(context, error, bytes, nbytes, flags, cas);
+      --context->async_count;
+      complete_op(f);
+      async_deliver(context, f, rval);
+    }
+    rip_ticket((int *) f);
+  }
+}
+
+void *handle_get(pylibcb_instance *context,
+		 const void *cookie,
+		 libcouchbase_error_t error,
+		 const void *key,
+		 libcouchbase_size_t nkey,
+		 const void *bytes,
+		 libcouchbase_size_t nbytes,
+		 libcouchbase_uint32_t flags,
+		 libcouchbase_cas_t cas) {
+  if (error == LIBCOUCHBASE_SUCCESS)
+    context->stats.bytes_received += nbytes;
+  else if (error == LIBCOUCHBASE_KEY_ENOENT)
+    ++context->stats.misses;
+
+  if (context->near.buckets) {
+    /* exports stream past the cache, a missing key still drops its entry */
+    if (error == LIBCOUCHBASE_SUCCESS && !((ticket *) cookie)->bulk)
+      near_store(context, key, nkey, bytes, nbytes, flags, cas);
+    else if (error == LIBCOUCHBASE_KEY_ENOENT)
+      near_written(context, key, nkey, 0);
+  }
+
+  if (((ticket *) cookie)->inflight)
+    coalesce_drop(&context->coalesce, ((ticket *) cookie)->inflight);
+
+  if (((ticket *) cookie)->expired) {
+    /* gets that joined it still wait for the retried response */
+    if (((ticket *) cookie)->followers && retry_request(context, (ticket *) cookie, error, key, nkey))
+      return 0;
+    coalesce_deliver(context, (ticket *) cookie, error, bytes, nbytes, flags, cas);
+    rip_ticket((int *) cookie);
+    return 0;
+  }
+
+  if (retry_request(context, (ticket *) cookie, error, key, nkey))
+    return 0;
+
+  if (((ticket *) cookie)->bulk) {
+    bulk_export_result((ticket *) cookie, error, key, nkey, bytes, nbytes, flags, cas);
+    return 0;
+  }
+
+  if (((ticket *) cookie)->multi)
+    return multi_get_callback((ticket *) cookie, error, key, nkey, bytes, nbytes, flags, cas);
+
+  if (context->async_mode) {
+    PyObject *rval = get_result(context, error, bytes, nbytes, flags, cas);
+    --context->async_count;
+    complete_op((ticket *) cookie);
+    async_deliver(context, (ticket *) cookie, rval);
+    coalesce_deliver(context, (ticket *) cookie, error, bytes, nbytes, flags, cas);
+    rip_ticket((int *) cookie);
+    return 0;
+  }
+
+  /* async mode was turned off while gets had joined this one */
+  coalesce_deliver(context, (ticket *) cookie, error, bytes, nbytes, flags, cas);
+  complete_op((ticket *) cookie);
+  int t = rip_ticket((int *) cookie);
+  if (t != context->callback_ticket)
+    return 0;
+  context->result = error;
+
+  switch (error) {
+  case LIBCOUCHBASE_SUCCESS:
+    break;
+  case LIBCOUCHBASE_KEY_ENOENT:
+    context->succeeded = 1;
+    return 0;
+  default:
+    return lcb_error(context, error, 1);
+  }
+  
+  context->returned_value = deliver_value(context, bytes, nbytes, flags, cas);
+  if (!context->returned_value) {
+    context->exception = 1;
+    return 0;
+  }
+  context->returned_cas = cas;
+  context->succeeded = 1;
+
+  return 0;
+}
+
+void *handle_set(pylibcb_instance *context,
+		 const void *cookie,
+		 libcouchbase_storage_t operation,
+		 libcouchbase_error_t error,
+		 const void *key,
+		 libcouchbase_size_t nkey,
+		 libcouchbase_cas_t cas) {
+  near_written(context, key, nkey, error == LIBCOUCHBASE_SUCCESS ? cas : 0);
+
+  /* replace, append and prepend only fail to store when the key is missing */
+  if (error == LIBCOUCHBASE_NOT_STORED && operation != LIBCOUCHBASE_SET && operation != LIBCOUCHBASE_ADD)
+    error = LIBCOUCHBASE_KEY_ENOENT;
+
+  if (((ticket *) cookie)->expired) {
+    rip_ticket((int *) cookie);
+    return 0;
+  }
+
+  if (retry_request(context, (ticket *) cookie, error, key, nkey))
+    return 0;
+
+  if (((ticket *) cookie)->bulk) {
+    bulk_result((ticket *) cookie, error, key, nkey);
+    return 0;
+  }
+
+  if (((ticket *) cookie)->multi)
+    return multi_store_callback((ticket *) cookie, error, key, nkey);
+
+  if (context->async_mode) {
+    PyObject *rval;
+    --context->async_count;
+    
+    switch(error) {
+    case LIBCOUCHBASE_SUCCESS:
+      Py_INCREF(Py_True);
+      rval = Py_True;
+      break;
+    default:
+      rval = lcb_error(context, error, 0);
+    }
+
+    complete_op((ticket *) cookie);
+    async_deliver(context, (ticket *) cookie, rval);
+    rip_ticket((int *) cookie);
+    return 0;
+  }
+
+  complete_op((ticket *) cookie);
+  int t = rip_ticket((int *) cookie);
+  if (t != context->callback_ticket)
+    return 0;
+  context->result = error;
+
+  switch (error) {
+  case LIBCOUCHBASE_SUCCESS:
+    break;
+  default:
+    return lcb_error(context, error, 1);
+  }
+
+  context->succeeded = 1;
+  return 0;
+}
+
+void *handle_remove(pylibcb_instance *context,
+		    const void *cookie,
+		    libcouchbase_error_t error,
+		    const void *key,
+		    libcouchbase_size_t nkey) {
+  near_written(context, key, nkey, 0);
+
+  if (((ticket *) cookie)->expired) {
+    rip_ticket((int *) cookie);
+    return 0;
+  }
+
+  if (retry_request(context, (ticket *) cookie, error, key, nkey))
+    return 0;
+
+  if (((ticket *) cookie)->multi)
+    return multi_store_callback((ticket *) cookie, error, key, nkey);
+
+  if (context->async_mode) {
+    PyObject *rval;
+    --context->async_count;
+    
+    switch (error) {
+    case LIBCOUCHBASE_SUCCESS:
+      Py_INCREF(Py_True);
+      rval = Py_True;
+      break;
+    default:
+      rval = lcb_error(context, error, 0);
+    }
+
+    complete_op((ticket *) cookie);
+    async_deliver(context, (ticket *) cookie, rval);
+    rip_ticket((int *) cookie);
+    return 0;
+  }
+
+  complete_op((ticket *) cookie);
+  int t = rip_ticket((int *) cookie);
+  if (t != context->callback_ticket)
+    return 0;
+  context->result = error;
+
+  switch (error) {
+  case LIBCOUCHBASE_SUCCESS:
+    break;
+  default:
+    return lcb_error(context, error, 1);
+  }  
+
+  context->succeeded = 1;
+  return 0;
+}
+
+PyObject *counter_value(libcouchbase_uint64_t value) {
+  if (value <= LONG_MAX)
+    return PyInt_FromLong((long) value);
+  return PyLong_FromUnsignedLongLong(value);
+}
+
+void *handle_arithmetic(pylibcb_instance *context,
+			const void *cookie,
+			libcouchbase_error_t error,
+			const void *key,
+			libcouchbase_size_t nkey,
+			libcouchbase_uint64_t value,
+			libcouchbase_cas_t cas) {
+  near_written(context, key, nkey, 0);
+
+  if (((ticket *) cookie)->expired) {
+    rip_ticket((int *) cookie);
+    return 0;
+  }
+
+  if (retry_request(context, (ticket *) cookie, error, key, nkey))
+    return 0;
+
+  if (((ticket *) cookie)->multi || context->async_mode) {
+    PyObject *rval;
+
+    switch (error) {
+    case LIBCOUCHBASE_SUCCESS:
+      rval = counter_value(value);
+      if (!rval)
+	rval = fetch_exception();
+      break;
+    default:
+      rval = lcb_error(context, error, 0);
+    }
+
+    if (((ticket *) cookie)->multi) {
+      multi_result((ticket *) cookie, key, nkey, rval);
+      return 0;
+    }
+
+    --context->async_count;
+    complete_op((ticket *) cookie);
+    async_deliver(context, (ticket *) cookie, rval);
+    rip_ticket((int *) cookie);
+    return 0;
+  }
+
+  complete_op((ticket *) cookie);
+  int t = rip_ticket((int *) cookie);
+  if (t != context->callback_ticket)
+    return 0;
+  context->result = error;
+
+  switch (error) {
+  case LIBCOUCHBASE_SUCCESS:
+    break;
+  default:
+    return lcb_error(context, error, 1);
+  }
+
+  context->returned_value = counter_value(value);
+  if (!context->returned_value) {
+    context->exception = 1;
+    return 0;
+  }
+  context->returned_cas = cas;
+  context->succeeded = 1;
+
+  return 0;
+}
+
+/* I/O thread side. an op is freed by whichever of its two owners lets go
+   last, so a caller that gave up on its timeout leaves it to the thread */
+
+void io_release(io_op *op) {
+  if (__sync_sub_and_fetch(&op->refs, 1))
+    return;
+  pthread_mutex_destroy(&op->lock);
+  pthread_cond_destroy(&op->cond);
+  free(op->bytes);
+  free(op);
+}
+
+void io_done(io_op *op, libcouchbase_error_t error, libcouchbase_cas_t cas) {
+  op->error = error;
+  op->result_cas = cas;
+  pthread_mutex_lock(&op->lock);
+  op->done = 1;
+  pthread_cond_signal(&op->cond);
+  pthread_mutex_unlock(&op->lock);
+  io_release(op);
+}
+
+void io_got(io_op *op,
+	    libcouchbase_error_t error,
+	    const void *bytes,
+	    libcouchbase_size_t nbytes,
+	    libcouchbase_uint32_t flags,
+	    libcouchbase_cas_t cas) {
+  if (error == LIBCOUCHBASE_SUCCESS) {
+    if (!(op->bytes = malloc(nbytes + 1)))
+      error = LIBCOUCHBASE_ENOMEM;
+    else {
+      memcpy(op->bytes, bytes, nbytes);
+      op->nbytes = nbytes;
+      op->result_flags = flags;
+    }
+  }
+  io_done(op, error, cas);
+}
+
+void io_submit(pylibcb_instance *context, io_op *op) {
+  const void *key = op->data;
+  libcouchbase_size_t nkey = op->nkey;
+
+  switch (op->kind) {
+  case OP_GET:
+  case OP_GAT:
+    libcouchbase_mget_by_key(context->cb, op, 0, 0, 1, &key, &nkey, op->kind == OP_GAT ? &op->expiry : 0);
+    break;
+  case OP_SET:
+    libcouchbase_store_by_key(context->cb, op, op->operation, 0, 0, key, nkey,
+			      op->data + nkey, op->nvalue, op->flags, op->expiry, op->cas);
+    break;
+  case OP_REMOVE:
+    libcouchbase_remove_by_key(context->cb, op, 0, 0, key, nkey, op->cas);
+    break;
+  case OP_ARITHMETIC:
+    libcouchbase_arithmetic_by_key(context->cb, op, 0, 0, key, nkey, op->delta, op->expiry, op->create, op->initial);
+    break;
+  }
+}
+
+/* everything queued since the last wakeup goes out in one pass of the
+   loop, so concurrent callers share writes to the server */
+void io_wake_callback(libcouchbase_socket_t sock, short which, void *cb_data) {
+  pylibcb_instance *context = cb_data;
+  io_thread *io = &context->io;
+  unsigned long long n;
+  io_op *op, *next, *fifo = 0;
+
+#ifdef __linux__
+  /* one read resets the counter */
+  while (read(io->wake[0], &n, sizeof(n)) == -1 && errno == EINTR)
+    ;
+#else
+  while (recv(io->wake[0], &n, sizeof(n), MSG_DONTWAIT) > 0)
+    ;
+#endif
+  for (op = __sync_lock_test_and_set(&io->queue, 0); op; op = next) {
+    next = op->next;
+    op->next = fifo;
+    fifo = op;
+  }
+
+  ++io->wakeups;
+  for (op = fifo; op; op = next) {
+    next = op->next;
+    ++io->ops;
+    io_submit(context, op);
+  }
+}
+
+void *io_main(void *arg) {
+  pylibcb_instance *context = arg;
+
+  while (!context->io.stop)
+    event_base_loop(context->base, EVLOOP_ONCE);
+  return 0;
+}
+
+int io_open_wake(io_thread *io) {
+#ifdef __linux__
+  io->wake[0] = io->wake[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return io->wake[0] == -1 ? -1 : 0;
+#else
+  return socketpair(AF_UNIX, SOCK_STREAM, 0, io->wake);
+#endif
+}
+
+int io_start(pylibcb_instance *context) {
+  io_thread *io = &context->io;
+
+  if (io_open_wake(io)) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    return -1;
+  }
+  event_assign(&io->wake_ev, context->base, io->wake[0], EV_READ | EV_PERSIST, io_wake_callback, context);
+  event_add(&io->wake_ev, 0);
+
+  io->running = 1;
+  if ((errno = pthread_create(&io->thread, 0, io_main, context))) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    io->running = 0;
+    event_del(&io->wake_ev);
+    io_close_wake(io);
+    return -1;
+  } return 0;
+}
+
+/* python side, called with the GIL */
+
+io_op *io_new(int kind, const void *key, libcouchbase_size_t nkey, PyObject *value) {
+  libcouchbase_size_t nvalue = value ? PyString_GET_SIZE(value) : 0;
+  io_op *op = calloc(1, sizeof(io_op) + nkey + nvalue);
+
+  if (!op) {
+    PyErr_SetString(OutOfMemory, "ran out of memory for an I/O thread op");
+    return 0;
+  }
+  op->kind = kind;
+  op->refs = 2;
+  pthread_mutex_init(&op->lock, 0);
+  pthread_cond_init(&op->cond, 0);
+  op->nkey = nkey;
+  memcpy(op->data, key, nkey);
+  if (value) {
+    op->nvalue = nvalue;
+    memcpy(op->data + nkey, PyString_AS_STRING(value), nvalue);
+  }
+  return op;
+}
+
+/* hands the op to the I/O thread and waits for it, returns -1 with an
+   exception set if it failed or timed out. the op must still be released */
+int io_call(pylibcb_instance *context, io_op *op, unsigned int usec, const char *what) {
+  io_thread *io = &context->io;
+  unsigned long long start = clock_usec();
+  struct timeval now;
+  struct timespec deadline;
+  io_op *head;
+  int done;
+
+  ++context->stats.ops[op->kind];
+  context->stats.bytes_sent += op->nkey + op->nvalue;
+
+  do {
+    head = io->queue;
+    op->next = head;
+  } while (!__sync_bool_compare_and_swap(&io->queue, head, op));
+  /* only the first op of a batch needs to wake the thread */
+  if (!head)
+    io_wake(io);
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&op->lock);
+  if (usec) {
+    gettimeofday(&now, 0);
+    deadline.tv_sec = now.tv_sec + (now.tv_usec + usec) / 1000000;
+    deadline.tv_nsec = (now.tv_usec + usec) % 1000000 * 1000;
+    while (!op->done && pthread_cond_timedwait(&op->cond, &op->lock, &deadline) != ETIMEDOUT)
+      ;
+  } else {
+    while (!op->done)
+      pthread_cond_wait(&op->cond, &op->lock);
+  }
+  done = op->done;
+  pthread_mutex_unlock(&op->lock);
+  Py_END_ALLOW_THREADS
+
+  histogram_add(&context->stats.latency[op->kind], clock_usec() - start);
+
+  if (!done) {
+    ++context->stats.timeouts;
+    PyErr_Format(Timeout, "timeout in %s", what);
+    return -1;
+  }
+
+  if (op->kind == OP_GET || op->kind == OP_GAT) {
+    if (op->error == LIBCOUCHBASE_SUCCESS)
+      context->stats.bytes_received += op->nbytes;
+    else if (op->error == LIBCOUCHBASE_KEY_ENOENT) {
+      ++context->stats.misses;
+      return 0;
+    }
+  }
+
+  if (op->error != LIBCOUCHBASE_SUCCESS) {
+    char *msg;
+    PyObject *type = lcb_error_type(op->error, &msg);
+    ++context->stats.errors[(unsigned) op->error < ERROR_SLOTS ? op->error : ERROR_SLOTS - 1];
+    PyErr_SetString(type, msg ? msg : "unknown error");
+    return -1;
+  } return 0;
+}
+
+PyObject *io_get(pylibcb_instance *context, const void *key, libcouchbase_size_t nkey,
+		 time_t expiry, int return_cas, unsigned int usec) {
+  PyObject *r = 0;
+  io_op *op = io_new(expiry ? OP_GAT : OP_GET, key, nkey, 0);
+  if (!op)
+    return 0;
+  op->expiry = expiry;
+
+  if (io_call(context, op, usec, "get"))
+    goto done;
+
+  if (op->error == LIBCOUCHBASE_KEY_ENOENT) {
+    if (context->near.buckets)
+      near_written(context, key, nkey, 0);
+    Py_INCREF(Py_None);
+    r = Py_None;
+    goto done;
+  }
+
+  if (context->near.buckets)
+    near_store(context, key, nkey, op->bytes, op->nbytes, op->result_flags, op->result_cas);
+  r = deliver_value(context, op->bytes, op->nbytes, op->result_flags, op->result_cas);
+  if (r && return_cas)
+    r = Py_BuildValue("Nk", r, (unsigned long) op->result_cas);
+
+ done:
+  io_release(op);
+  return r;
+}
+
+int io_store(pylibcb_instance *context, libcouchbase_storage_t operation, const void *key, libcouchbase_size_t nkey,
+	     PyObject *value, libcouchbase_uint32_t flags, time_t expiry, libcouchbase_cas_t cas, unsigned int usec) {
+  io_op *op = io_new(OP_SET, key, nkey, value);
+  if (!op)
+    return -1;
+  op->operation = operation;
+  op->flags = flags;
+  op->expiry = expiry;
+  op->cas = cas;
+
+  int r = io_call(context, op, usec, storage_names[operation]);
+  near_written(context, key, nkey, !r ? op->result_cas : 0);
+  io_release(op);
+  return r;
+}
+
+int io_remove(pylibcb_instance *context, const void *key, libcouchbase_size_t nkey,
+	      libcouchbase_cas_t cas, unsigned int usec) {
+  io_op *op = io_new(OP_REMOVE, key, nkey, 0);
+  if (!op)
+    return -1;
+  op->cas = cas;
+
+  int r = io_call(context, op, usec, "remove");
+  near_written(context, key, nkey, 0);
+  io_release(op);
+  return r;
+}
+
+PyObject *io_arithmetic(pylibcb_instance *context, const void *key, libcouchbase_size_t nkey,
+			long long delta, unsigned long long initial, int create,
+			time_t expiry, unsigned int usec) {
+  PyObject *r = 0;
+  io_op *op = io_new(OP_ARITHMETIC, key, nkey, 0);
+  if (!op)
+    return 0;
+  op->delta = delta;
+  op->initial = initial;
+  op->create = create;
+  op->expiry = expiry;
+
+  if (!io_call(context, op, usec, "arithmetic"))
+    r = counter_value(op->counter);
+  near_written(context, key, nkey, 0);
+  io_release(op);
+  return r;
+}
+
+#define TRACE_CALLBACK(z, n) if ((z)->trace.ring) {	\
+    (z)->trace.called = clock_usec();			\
+    (z)->trace.received = (n);				\
+  }
+
+void *get_callback(libcouchbase_t instance,
+		   const void *cookie,
+		   libcouchbase_error_t error,
+		   const void *key,
+		   libcouchbase_size_t nkey,
+		   const void *bytes,
+		   libcouchbase_size_t nbytes,
+		   libcouchbase_uint32_t flags,
+		   libcouchbase_cas_t cas) {
+  pylibcb_instance *context = (pylibcb_instance *) libcouchbase_get_cookie(instance);
+  if (context->io.running) {
+    io_got((io_op *) cookie, error, bytes, nbytes, flags, cas);
+    return 0;
+  }
+  TRACE_CALLBACK(context, nbytes);
+  CALLBACK_ENTER(context);
+  handle_get(context, cookie, error, key, nkey, bytes, nbytes, flags, cas);
+  CALLBACK_EXIT(context);
+  context->trace.called = 0;
+  return 0;
+}
+
+void *set_callback(libcouchbase_t instance,
+		   const void *cookie,
+		   libcouchbase_storage_t operation,
+		   libcouchbase_error_t error,
+		   const void *key,
+		   libcouchbase_size_t nkey,
+		   libcouchbase_cas_t cas) {
+  pylibcb_instance *context = (pylibcb_instance *) libcouchbase_get_cookie(instance);
+  if (context->io.running) {
+    /* replace, append and prepend only fail to store when the key is missing */
+    if (error == LIBCOUCHBASE_NOT_STORED && operation != LIBCOUCHBASE_SET && operation != LIBCOUCHBASE_ADD)
+      error = LIBCOUCHBASE_KEY_ENOENT;
+    io_done((io_op *) cookie, error, cas);
+    return 0;
+  }
+  TRACE_CALLBACK(context, 0);
+  CALLBACK_ENTER(context);
+  handle_set(context, cookie, operation, error, key, nkey, cas);
+  CALLBACK_EXIT(context);
+  context->trace.called = 0;
+  return 0;
+}
+
+void *remove_callback(libcouchbase_t instance,
+		      const void *cookie,
+		      libcouchbase_error_t error,
+		      const void *key,
+		      libcouchbase_size_t nkey) {
+  pylibcb_instance *context = (pylibcb_instance *) libcouchbase_get_cookie(instance);
+  if (context->io.running) {
+    io_done((io_op *) cookie, error, 0);
+    return 0;
+  }
+  TRACE_CALLBACK(context, 0);
+  CALLBACK_ENTER(context);
+  handle_remove(context, cookie, error, key, nkey);
+  CALLBACK_EXIT(context);
+  context->trace.called = 0;
+  return 0;
+}
+
+void *arithmetic_callback(libcouchbase_t instance,
+			  const void *cookie,
+			  libcouchbase_error_t error,
+			  const void *key,
+			  libcouchbase_size_t nkey,
+			  libcouchbase_uint64_t value,
+			  libcouchbase_cas_t cas) {
+  pylibcb_instance *context = (pylibcb_instance *) libcouchbase_get_cookie(instance);
+  if (context->io.running) {
+    ((io_op *) cookie)->counter = value;
+    io_done((io_op *) cookie, error, cas);
+    return 0;
+  }
+  TRACE_CALLBACK(context, 0);
+  CALLBACK_ENTER(context);
+  handle_arithmetic(context, cookie, error, key, nkey, value, cas);
+  CALLBACK_EXIT(context);
+  context->trace.called = 0;
+  return 0;
+}
+
+static PyObject *open(PyObject *self, PyObject *args) {
+  char *host = 0;
+  char *user = 0;
+  char *passwd = 0;
+  char *bucket = 0;
+  int external_loop = 0;
+  int io_thread = 0;
+
+  if (!PyArg_ParseTuple(args, "|ssssii", &host, &user, &passwd, &bucket, &external_loop, &io_thread))
+    return 0;
+
+  if (external_loop && io_thread) {
+    PyErr_SetString(Failure, "an instance cannot have both an external event loop and an I/O thread");
+    return 0;
+  }
+
+  if (!strlen(host))
+    host = 0;
+  if (!strlen(user))
+    user = 0;
+  if (!strlen(passwd))
+    passwd = 0;
+  if (!strlen(bucket))
+    passwd = 0;
+
+  pylibcb_instance *z = calloc(1, sizeof(pylibcb_instance));
+  if (!z) {
+    PyErr_SetString(OutOfMemory, "ran out of memory while allocating pylibcb instance");
+    return 0;
+  }
+
+  if (!arena_grow(&z->arena)) {
+    PyErr_SetString(OutOfMemory, "ran out of memory while allocating pylibcb instance");
+    goto free_instance;
+  }
+
+  z->base = event_base_new();
+  if (!z) {
+    PyErr_SetString(OutOfMemory, "could not create event base for new instance");
+    goto free_instance;
+  }
+  event_assign(&z->wheel.ev, z->base, -1, 0, wheel_callback, z);
+
+  libcouchbase_error_t e = LIBCOUCHBASE_SUCCESS;
+  libcouchbase_io_opt_t *cb_base = libcouchbase_create_io_ops(LIBCOUCHBASE_IO_OPS_LIBEVENT, z->base, &e);
+  if (e == LIBCOUCHBASE_NOT_SUPPORTED) {
+    PyErr_SetString(Failure, "libcouchbase as built on this platform does not support libevent ?");
+    goto free_event_base;
+  } else if (e == LIBCOUCHBASE_ENOMEM) {
+    PyErr_SetString(OutOfMemory, "ran out of memory while setting up libcouchbase event loop");
+    goto free_event_base;
+  } else if (e == LIBCOUCHBASE_ERROR) {
+    PyErr_SetString(Failure, "a failure occurred while setting up libcouchbase event loop (probably couldn't locate libcouchbase_event shared library)");
+    goto free_event_base;
+    return 0;
+  } else if (e != LIBCOUCHBASE_SUCCESS) {
+    PyErr_SetString(Failure, "an unhandled error condition occurred when calling libcouchbase_create_io_ops");
+    goto free_event_base;
+  }
+
+  if (external_loop) {
+#ifdef __linux__
+    libcouchbase_io_opt_t *wrapped = wrap_io_ops(cb_base);
+    if (!wrapped) {
+      PyErr_SetString(OutOfMemory, "could not set up external event loop support");
+      goto free_event_base;
+    }
+    cb_base = wrapped;
+    z->loop_io = wrapped;
+#else
+    PyErr_SetString(Failure, "external event loops are only supported on linux");
+    goto free_event_base;
+#endif
+  }
+  
+  z->cb = libcouchbase_create(host, user, passwd, bucket, cb_base);
+  if (!z->cb) {
+    /* unsure what to do with libcouchbase_io_ops_t created in last step */
+    PyErr_SetString(OutOfMemory, "could not create libcouchbase instance");
+    goto free_event_base;
+  }
+
+  libcouchbase_set_cookie(z->cb, z);
+  libcouchbase_set_error_callback(z->cb, (libcouchbase_error_callback) error_callback);
+  libcouchbase_set_storage_callback(z->cb, (libcouchbase_storage_callback) set_callback);
+  libcouchbase_set_get_callback(z->cb, (libcouchbase_get_callback) get_callback);
+  libcouchbase_set_remove_callback(z->cb, (libcouchbase_remove_callback) remove_callback);
+  libcouchbase_set_arithmetic_callback(z->cb, (libcouchbase_arithmetic_callback) arithmetic_callback);
+  
+  z->error_string = "libcouchbase_connect";
+  z->error_exception = ConnectionFailure;
+
+  if (libcouchbase_connect(z->cb) != LIBCOUCHBASE_SUCCESS) {
+    goto free_event_base;
+  }
+
+  /* establish connection */
+  instance_wait(z);
+  if (z->internal_exception) {
+    goto free_event_base;
+  }
+
+  z->error_string = "internal exception";
+  z->error_exception = Failure;
+
+  z->async_limit = 20; /* maximum number of async events that may be queued up on the event loop */
+
+  if (io_thread && io_start(z)) {
+    libcouchbase_destroy(z->cb);
+    goto free_event_base;
+  }
+
+  return PyCObject_FromVoidPtrAndDesc(z, pylibcb_instance_desc, pylibcb_instance_dest);
+
+ free_event_base:
+  free(z->base);
+ free_instance:
+  arena_destroy(&z->arena);
+
+  free(z);
+  return 0;
+}
+
+/* native connection type, the base of Client. its hottest methods are
+   called without a python wrapper, find their instance without checking a
+   PyCObject's descriptor, and skip keyword parsing for positional calls */
+
+typedef struct t_pylibcb_connection {
+  PyObject_HEAD
+  pylibcb_instance *context;
+  PyObject *handle; /* PyCObject owning the instance */
+  unsigned int timeout; /* default deadline in usecs */
+} pylibcb_connection;
+
+static PyTypeObject ConnectionType;
+
+int pyobject_is_pylibcb_instance(PyObject *x) {
+  if (!PyCObject_Check(x)
+      || memcmp(PyCObject_GetDesc(x), pylibcb_instance_desc, sizeof("pylibcb_instance"))) {
+    PyErr_SetString(Failure, "need pylibcb instance as first argument");
+    return 0;
+  } return 1;
+}
+
+pylibcb_instance *get_context(PyObject *x) {
+  pylibcb_instance *context;
+
+  if (PyObject_TypeCheck(x, &ConnectionType)) {
+    if (!(context = ((pylibcb_connection *) x)->context)) {
+      PyErr_SetString(Failure, "connection is not open");
+      return 0;
+    }
+  } else if (!pyobject_is_pylibcb_instance(x))
+    return 0;
+  else
+    context = PyCObject_AsVoidPtr(x);
+
+  if (context->waiting) {
+    /* completion callbacks may queue more requests */
+    if (context->in_callback && context->owner == PyThreadState_GET())
+      return context;
+
+    PyErr_SetString(Failure, "pylibcb instance is already running its event loop");
+    return 0;
+  }
+
+  context->succeeded = 0;
+  context->timed_out = 0;
+  context->exception = 0;
+  context->internal_exception = 0;
+  return context;
+}
+
+int *new_ticket(pylibcb_instance *context) {
+  int *t = alloc_ticket(context);
+  if (!t) {
+    PyErr_SetString(OutOfMemory, "ran out of memory for new callback tracking tickets");
+    return 0;
+  } return t;
+}
+
+int check_callback(pylibcb_instance *context, PyObject **callback) {
+  if (*callback == Py_None)
+    *callback = 0;
+  if (!*callback)
+    return 0;
+
+  if (!PyCallable_Check(*callback)) {
+    PyErr_SetString(PyExc_TypeError, "callback must be callable");
+    return -1;
+  }
+
+  if (!context->async_mode) {
+    PyErr_SetString(Failure, "completion callbacks need async mode");
+    return -1;
+  } return 0;
+}
+
+void attach_callback(int *t, PyObject *callback) {
+  Py_XINCREF(callback);
+  ((ticket *) t)->callback = callback;
+}
+
+/* bulk operations share one ticket whose reference count covers every
+   key plus the caller, and whose pending count covers every key plus the
+   submission itself so the batch cannot complete while it is being queued.
+   a deadline covers the whole batch, keys without a result by then are
+   reported as timed out */
+
+int *begin_multi(pylibcb_instance *context, PyObject *keys, unsigned int usec, int op) {
+  IO_THREAD_GUARD("bulk operations");
+
+  int *_ticket = new_ticket(context);
+  if (!_ticket)
+    return 0;
+
+  ticket *_t = (ticket *) _ticket;
+  _t->multi = PyDict_New();
+  if (!_t->multi || (usec && !(_t->keys = PySequence_Tuple(keys)))) {
+    rip_ticket(hand_out_ticket(_ticket));
+    return 0;
+  }
+  _t->pending = 1;
+  _t->submitting = 1;
+
+  mark_op(_ticket, op);
+  wheel_add(context, _ticket, usec);
+  return hand_out_ticket(_ticket);
+}
+
+/* returns 1 once the batch deadline has passed, -1 on errors */
+int multi_window(int *_ticket) {
+  ticket *_t = (ticket *) _ticket;
+  pylibcb_instance *context = _t->instance;
+
+  /* instead of refusing with AsyncLimit, run the event loop until the
+     number of requests in flight drops below the limit */
+  int limit = _t->bulk && _t->bulk->window ? _t->bulk->window : context->async_limit;
+
+  while (!_t->expired
+	 && (_t->pending - 1 >= limit
+	     || (context->async_mode && context->async_count >= context->async_limit))) {
+    instance_loop_once(context);
+    if (context->internal_exception || context->exception)
+      return -1;
+  }
+
+  return _t->expired;
+}
+
+void multi_submitted(int *_ticket, Py_ssize_t sent) {
+  pylibcb_instance *context = ((ticket *) _ticket)->instance;
+  ++context->stats.ops[((ticket *) _ticket)->op];
+  context->stats.bytes_sent += sent;
+  ++((ticket *) _ticket)->pending;
+  hand_out_ticket(_ticket);
+  if (context->async_mode)
+    ++context->async_count;
+}
+
+PyObject *end_multi(int *_ticket) {
+  ticket *_t = (ticket *) _ticket;
+  pylibcb_instance *context = _t->instance;
+  PyObject *r = 0;
+
+  _t->submitting = 0;
+  if (!--_t->pending)
+    complete_op(_t);
+
+  if (context->async_mode) {
+    if (!_t->pending) {
+      Py_INCREF(_t->multi);
+      async_deliver(context, _t, _t->multi);
+    }
+    r = Py_BuildValue("i", _ticket[0]);
+    rip_ticket(_ticket);
+    return r;
+  }
+
+  while (_t->pending && !context->internal_exception && !context->exception)
+    instance_wait(context);
+
+  if (!context->internal_exception && !context->exception) {
+    r = _t->multi;
+    Py_INCREF(r);
+  }
+
+  rip_ticket(_ticket);
+  arena_reset(&context->arena);
+  return r;
+}
+
+void abandon_multi(int *_ticket) {
+  ticket *_t = (ticket *) _ticket;
+
+  /* requests already queued still complete into the ticket's dict */
+  _t->submitting = 0;
+  if (!--_t->pending)
+    complete_op(_t);
+  rip_ticket(_ticket);
+}
+
+pylibcb_instance *get_loop_context(PyObject *args) {
+  PyObject *cb;
+
+  if (!PyArg_ParseTuple(args, "O", &cb))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  if (!context->loop_io) {
+    PyErr_SetString(Failure, "instance was not opened for an external event loop");
+    return 0;
+  } return context;
+}
+
+static PyObject *loop_fd(PyObject *self, PyObject *args) {
+  pylibcb_instance *context = get_loop_context(args);
+  if (!context)
+    return 0;
+
+#ifdef __linux__
+  return PyInt_FromLong(((loop_io *) context->loop_io)->epfd);
+#else
+  Py_RETURN_NONE;
+#endif
+}
+
+static PyObject *loop_timeout(PyObject *self, PyObject *args) {
+  pylibcb_instance *context = get_loop_context(args);
+  if (!context)
+    return 0;
+
+  double t = wheel_next_timeout(context);
+  double r = retry_next_timeout(context);
+  if (r >= 0 && (t < 0 || r < t))
+    t = r;
+#ifdef __linux__
+  double l = loop_next_timeout((loop_io *) context->loop_io);
+  if (l >= 0 && (t < 0 || l < t))
+    t = l;
+#endif
+  if (t >= 0)
+    return PyFloat_FromDouble(t);
+  Py_RETURN_NONE;
+}
+
+static PyObject *loop_step(PyObject *self, PyObject *args) {
+  pylibcb_instance *context = get_loop_context(args);
+  if (!context)
+    return 0;
+
+  if (instance_reentered(context))
+    return 0;
+
+#ifdef __linux__
+  struct timeval before;
+  gettimeofday(&before, 0);
+#endif
+
+  trace_flush(&context->trace);
+  event_base_loop(context->base, EVLOOP_NONBLOCK);
+
+#ifdef __linux__
+  loop_expire_timers((loop_io *) context->loop_io, &before);
+#endif
+  INTERNAL_EXCEPTION_HANDLER(return 0);
+
+  if (raise_callback_error(context))
+    return 0;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *get_async_limit(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  
+  if (!PyArg_ParseTuple(args, "O", &cb))
+    return 0;
+
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  return PyInt_FromLong(context->async_limit);
+}
+
+static PyObject *set_async_limit(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  int limit;
+
+  if (!PyArg_ParseTuple(args, "Oi", &cb, &limit))
+    return 0;
+
+  if (limit < 1) {
+    PyErr_SetString(Failure, "limit must be an integer value greater than 0");
+    return 0;
+  } else if (limit > 16384) {
+    PyErr_SetString(Failure, "there is an arbitrary upper limit of 16384 simultaneous requests as that is enough for anyone");
+    return 0;
+  }
+
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  /* room for a full window of results up front, the buffer grows if
+     results are collected less often than that */
+  if (context->async.size < limit * 2 && async_size(&context->async, limit * 2))
+    return 0;
+  context->async_limit = limit;
+
+  /* an adaptive window continues from the new limit */
+  aimd *a = &context->adaptive;
+  if (a->enabled)
+    context->async_limit = a->window = limit < a->min ? a->min : limit > a->max ? a->max : limit;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *set_retry_policy(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  int attempts;
+  unsigned int backoff = 1000, max_backoff = 100000, deadline = 1000000;
+
+  if (!PyArg_ParseTuple(args, "Oi|III", &cb, &attempts, &backoff, &max_backoff, &deadline))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  IO_THREAD_GUARD("retrying");
+
+  if (attempts < 0 || max_backoff < backoff) {
+    PyErr_SetString(Failure, "retry policy needs attempts >= 0 and max_backoff >= backoff");
+    return 0;
+  }
+
+  retry_policy *p = &context->retry;
+  p->attempts = attempts;
+  p->backoff = backoff;
+  p->max_backoff = max_backoff;
+  p->deadline = deadline;
+  if (!p->seed)
+    p->seed = clock_usec() ^ (unsigned long long) (size_t) context;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *set_adaptive_window(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  int enabled, min = 1, max = 16384;
+
+  if (!PyArg_ParseTuple(args, "Oi|ii", &cb, &enabled, &min, &max))
+    return 0;
+
+  if (min < 1 || max < min || max > 16384) {
+    PyErr_SetString(Failure, "window bounds must satisfy 1 <= min <= max <= 16384");
+    return 0;
+  }
+
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  aimd *a = &context->adaptive;
+  if (!enabled) {
+    /* the limit stays where the window left it */
+    a->enabled = 0;
+    Py_RETURN_NONE;
+  }
+
+  int limit = context->async_limit;
+  limit = limit < min ? min : limit > max ? max : limit;
+  if (context->async.size < limit * 2 && async_size(&context->async, limit * 2))
+    return 0;
+
+  memset(a, 0, sizeof(aimd));
+  a->enabled = 1;
+  a->min = min;
+  a->max = max;
+  context->async_limit = a->window = a->epoch_window = limit;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *get_async_count(PyObject *self, PyObject *args) {
+  PyObject *cb;
+
+  if (!PyArg_ParseTuple(args, "O", &cb))
+    return 0;
+
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+  return PyInt_FromLong(context->async_count);
+}
+
+static PyObject *enable_async(PyObject *self, PyObject *args) {
+  PyObject *cb;
+
+  if (!PyArg_ParseTuple(args, "O", &cb))
+      return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  IO_THREAD_GUARD("async mode");
+
+  if (context->async.size < context->async_limit * 2 && async_size(&context->async, context->async_limit * 2))
+    return 0;
+  context->async_mode = 1;
+  context->async_count = 0;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *disable_async(PyObject *self, PyObject *args) {
+  PyObject *cb;
+
+  if (!PyArg_ParseTuple(args, "O", &cb))
+      return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  context->async_mode = 0;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *enable_buffer_values(PyObject *self, PyObject *args) {
+  PyObject *cb;
+
+  if (!PyArg_ParseTuple(args, "O", &cb))
+      return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  context->buffer_values = 1;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *disable_buffer_values(PyObject *self, PyObject *args) {
+  PyObject *cb;
+
+  if (!PyArg_ParseTuple(args, "O", &cb))
+      return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  context->buffer_values = 0;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *get_copy_avoided_bytes(PyObject *self, PyObject *args) {
+  PyObject *cb;
+
+  if (!PyArg_ParseTuple(args, "O", &cb))
+      return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  return PyLong_FromUnsignedLongLong(context->copy_avoided_bytes);
+}
+
+PyObject *histogram_stats(histogram *h, PyObject *percentiles) {
+  Py_ssize_t i, n = PySequence_Fast_GET_SIZE(percentiles);
+  char name[32];
+
+  PyObject *r = Py_BuildValue("{s:K,s:K,s:K,s:d}",
+			      "count", h->count, "min", h->min, "max", h->max,
+			      "mean", h->count ? (double) h->sum / h->count : 0.0);
+  if (!r)
+    return 0;
+
+  for (i = 0; i < n; ++i) {
+    double p = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(percentiles, i));
+    snprintf(name, sizeof(name), "p%g", p);
+
+    PyObject *v = PyLong_FromUnsignedLongLong(histogram_percentile(h, p));
+    if (!v || PyDict_SetItemString(r, name, v)) {
+      Py_XDECREF(v);
+      Py_DECREF(r);
+      return 0;
+    }
+    Py_DECREF(v);
+  } return r;
+}
+
+PyObject *arena_stats(op_arena *a) {
+  return Py_BuildValue("{s:i,s:i,s:i,s:i,s:n,s:K,s:K}",
+		       "chunks", a->nchunks, "records", a->nchunks * ARENA_CHUNK,
+		       "in_use", a->in_use, "high_water", a->high_water,
+		       "bytes", (Py_ssize_t) (a->nchunks * sizeof(op_chunk)),
+		       "resets", a->resets, "trimmed", a->trimmed);
+}
+
+/* records carved out of chunks since the last reset and records on the
+   free list, for the slab counters stats() used to report */
+void arena_usage(op_arena *a, int *carved, int *free) {
+  op_chunk *c;
+  ticket *t;
+
+  for (*carved = 0, c = a->chunks; c; c = c->next)
+    *carved += c->used;
+  for (*free = 0, t = a->free; t; t = t->next)
+    ++*free;
+}
+
+PyObject *adaptive_stats(pylibcb_instance *context) {
+  aimd *a = &context->adaptive;
+  int i, n = a->history_next < AIMD_HISTORY ? a->history_next : AIMD_HISTORY;
+  PyObject *history = PyList_New(n);
+  if (!history)
+    return 0;
+
+  /* oldest adjustment first */
+  for (i = 0; i < n; ++i) {
+    aimd_event *e = &a->history[(a->history_next - n + i) % AIMD_HISTORY];
+    PyObject *x = Py_BuildValue("(diis)", e->time, e->from, e->to, e->reason);
+    if (!x) {
+      Py_DECREF(history);
+      return 0;
+    }
+    PyList_SET_ITEM(history, i, x);
+  }
+
+  return Py_BuildValue("{s:i,s:i,s:i,s:i,s:K,s:K,s:K,s:N}",
+		       "adaptive", a->enabled, "limit", context->async_limit,
+		       "min", a->min, "max", a->max,
+		       "increases", a->increases, "decreases", a->decreases,
+		       "baseline_p99", a->baseline, "history", history);
+}
+
+static PyObject *stats(PyObject *self, PyObject *args) {
+  PyObject *cb, *percentiles = 0, *r = 0, *latency = 0, *batches = 0, *ops = 0, *errors = 0, *compression = 0, *near = 0, *window = 0, *io = 0, *arena = 0, *coalesce = 0, *trace = 0;
+  int reset = 0, i;
+
+  if (!PyArg_ParseTuple(args, "O|Oi", &cb, &percentiles, &reset))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  if (!percentiles || percentiles == Py_None)
+    percentiles = Py_BuildValue("(ddd)", 50.0, 99.0, 99.9);
+  else
+    percentiles = PySequence_Fast(percentiles, "percentiles must be a sequence");
+  if (!percentiles)
+    return 0;
+
+  for (i = 0; i < PySequence_Fast_GET_SIZE(percentiles); ++i) {
+    double p = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(percentiles, i));
+    if (PyErr_Occurred())
+      goto done;
+    if (p < 0 || p > 100) {
+      PyErr_SetString(PyExc_ValueError, "percentiles must be between 0 and 100");
+      goto done;
+    }
+  }
+
+  op_stats *z = &context->stats;
+  latency = PyDict_New();
+  batches = PyDict_New();
+  ops = PyDict_New();
+  errors = PyDict_New();
+  if (!latency || !batches || !ops || !errors)
+    goto done;
+
+  for (i = 0; i < OP_TYPES; ++i) {
+    PyObject *h = histogram_stats(&z->latency[i], percentiles);
+    PyObject *b = histogram_stats(&z->batches[i], percentiles);
+    PyObject *n = PyLong_FromUnsignedLongLong(z->ops[i]);
+    int failed = !h || !b || !n || PyDict_SetItemString(latency, op_names[i], h)
+      || PyDict_SetItemString(batches, op_names[i], b) || PyDict_SetItemString(ops, op_names[i], n);
+
+    Py_XDECREF(h);
+    Py_XDECREF(b);
+    Py_XDECREF(n);
+    if (failed)
+      goto done;
+  }
+
+  for (i = 0; i < ERROR_SLOTS; ++i) {
+    char *name;
+    if (!z->errors[i])
+      continue;
+
+    lcb_error_type(i, &name);
+    PyObject *k = name ? PyString_FromString(name) : PyInt_FromLong(i);
+    PyObject *n = PyLong_FromUnsignedLongLong(z->errors[i]);
+    int failed = !k || !n || PyDict_SetItem(errors, k, n);
+
+    Py_XDECREF(k);
+    Py_XDECREF(n);
+    if (failed)
+      goto done;
+  }
+
+  compression = Py_BuildValue("{s:K,s:K,s:K,s:K,s:d,s:K,s:K,s:K}",
+			      "compressed", z->compressed, "skipped", z->compress_skipped,
+			      "bytes_in", z->compress_in, "bytes_out", z->compress_out,
+			      "ratio", z->compress_in ? (double) z->compress_out / z->compress_in : 1.0,
+			      "compress_usec", z->compress_usec,
+			      "decompressed", z->decompressed, "decompress_usec", z->decompress_usec);
+  if (!compression)
+    goto done;
+
+  near = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:i,s:n}",
+		       "hits", z->near_hits, "misses", z->near_misses,
+		       "evictions", z->near_evictions, "expirations", z->near_expirations,
+		       "invalidations", z->near_invalidations,
+		       "entries", context->near.entries, "bytes", context->near.bytes);
+  if (!near)
+    goto done;
+
+  window = adaptive_stats(context);
+  if (!window)
+    goto done;
+
+  /* ops per wakeup shows how much concurrent callers batch their writes */
+  if (context->io.running)
+    io = Py_BuildValue("{s:K,s:K,s:d}", "wakeups", context->io.wakeups, "ops", context->io.ops,
+		       "ops_per_wakeup", context->io.wakeups ? (double) context->io.ops / context->io.wakeups : 0.0);
+  else {
+    Py_INCREF(Py_None);
+    io = Py_None;
+  }
+  if (!io)
+    goto done;
+
+  arena = arena_stats(&context->arena);
+  if (!arena)
+    goto done;
+
+  coalesce = Py_BuildValue("{s:K,s:K,s:d,s:i,s:i}", "sent", z->coalesce_sent, "coalesced", z->coalesced,
+			   "ratio", z->coalesced ? (double) z->coalesced / (z->coalesced + z->coalesce_sent) : 0.0,
+			   "in_flight", context->coalesce.entries, "enabled", context->coalesce.enabled);
+  if (!coalesce)
+    goto done;
+
+  if (context->trace.ring)
+    trace = Py_BuildValue("{s:K,s:i,s:K,s:K,s:K}", "threshold_usec", context->trace.threshold,
+			  "entries", context->trace.size, "recorded", context->trace.written,
+			  "pending", context->trace.written - context->trace.read,
+			  "overwritten", context->trace.overwritten);
+  else {
+    Py_INCREF(Py_None);
+    trace = Py_None;
+  }
+  if (!trace)
+    goto done;
+
+  /* the slab counters are kept as aliases: timer events live in the
+     records now, so both kinds report the arena */
+  int carved, free_records;
+  arena_usage(&context->arena, &carved, &free_records);
+
+  r = Py_BuildValue("{s:O,s:O,s:O,s:K,s:K,s:K,s:K,s:O,s:K,s:K,s:O,s:O,s:O,s:O,s:O,s:O,s:O,s:i,s:i,s:i,s:i,s:i,s:i,s:i}",
+		    "latency", latency, "batch_latency", batches, "ops", ops,
+		    "bytes_sent", z->bytes_sent, "bytes_received", z->bytes_received,
+		    "misses", z->misses, "timeouts", z->timeouts, "errors", errors,
+		    "retries", z->retries, "retries_exhausted", z->retries_exhausted,
+		    "compression", compression, "near_cache", near, "coalescing", coalesce,
+		    "window", window, "io_thread", io,
+		    "arena", arena, "trace", trace, "deadlines", context->wheel.count,
+		    "ticket_slabs", context->arena.nchunks, "tickets", carved, "free_tickets", free_records,
+		    "event_slabs", context->arena.nchunks, "events", carved, "free_events", free_records);
+
+  if (r && reset)
+    memset(z, 0, sizeof(op_stats));
+
+ done:
+  Py_DECREF(percentiles);
+  Py_XDECREF(latency);
+  Py_XDECREF(batches);
+  Py_XDECREF(ops);
+  Py_XDECREF(errors);
+  Py_XDECREF(compression);
+  Py_XDECREF(near);
+  Py_XDECREF(window);
+  Py_XDECREF(io);
+  Py_XDECREF(arena);
+  Py_XDECREF(coalesce);
+  Py_XDECREF(trace);
+  return r;
+}
+
+static PyObject *set_transcoding(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  int enabled;
+
+  if (!PyArg_ParseTuple(args, "Oi", &cb, &enabled))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  context->transcoding = enabled;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *set_compression(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  Py_ssize_t threshold;
+  int codec = COMPRESS_DEFAULT;
+
+  if (!PyArg_ParseTuple(args, "On|i", &cb, &threshold, &codec))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  if (codec != COMPRESS_ZLIB
+#ifdef HAVE_LZ4
+      && codec != COMPRESS_LZ4
+#endif
+      ) {
+    PyErr_Format(Failure, "unsupported compression codec 0x%x", codec);
+    return 0;
+  }
+
+  /* a threshold of 0 turns compression off */
+  context->compression = threshold > 0 ? codec : 0;
+  context->compress_threshold = threshold;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *enable_near_cache(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  int max_entries;
+  Py_ssize_t max_bytes;
+  unsigned long ttl;
+  unsigned int size = 1;
+
+  if (!PyArg_ParseTuple(args, "Oink", &cb, &max_entries, &max_bytes, &ttl))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  if (max_entries < 1 || max_bytes < 1 || !ttl) {
+    PyErr_SetString(PyExc_ValueError, "near cache needs positive entry, byte and ttl limits");
+    return 0;
+  }
+
+  /* reconfiguring starts over with an empty cache */
+  near_clear(&context->near);
+  while (size < (unsigned int) max_entries && size < 1 << 30)
+    size <<= 1;
+
+  context->near.buckets = calloc(size, sizeof(near_entry *));
+  if (!context->near.buckets) {
+    PyErr_SetString(OutOfMemory, "ran out of memory while allocating near cache");
+    return 0;
+  }
+  context->near.mask = size - 1;
+  context->near.max_entries = max_entries;
+  context->near.max_bytes = max_bytes;
+  context->near.ttl = ttl;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *disable_near_cache(PyObject *self, PyObject *args) {
+  PyObject *cb;
+
+  if (!PyArg_ParseTuple(args, "O", &cb))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  near_clear(&context->near);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *set_get_coalescing(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  int enabled;
+
+  if (!PyArg_ParseTuple(args, "Oi", &cb, &enabled))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  /* gets already joined still get their leader's response */
+  if (!enabled)
+    coalesce_clear(&context->coalesce);
+  context->coalesce.enabled = enabled;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *enable_trace(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  unsigned long threshold;
+  int entries;
+
+  if (!PyArg_ParseTuple(args, "Oki", &cb, &threshold, &entries))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  if (entries < 1) {
+    PyErr_SetString(PyExc_ValueError, "trace needs room for at least one entry");
+    return 0;
+  }
+
+  /* reconfiguring starts over with an empty ring */
+  trace_entry *ring = calloc(entries, sizeof(trace_entry));
+  if (!ring) {
+    PyErr_SetString(OutOfMemory, "ran out of memory while allocating trace");
+    return 0;
+  }
+  trace_reset(&context->trace);
+  context->trace.ring = ring;
+  context->trace.size = entries;
+  context->trace.threshold = threshold;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *disable_trace(PyObject *self, PyObject *args) {
+  PyObject *cb;
+
+  if (!PyArg_ParseTuple(args, "O", &cb))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  trace_reset(&context->trace);
+
+  Py_RETURN_NONE;
+}
+
+/* phase ends are reported in microseconds after submission, which is
+   converted to wall clock time for lining entries up with other logs */
+PyObject *trace_phase(trace_entry *e, unsigned long long end) {
+  if (end)
+    return PyLong_FromUnsignedLongLong(end - e->submit);
+  Py_RETURN_NONE;
+}
+
+/* keys are binary, bytes other than printable ascii are escaped as \xNN
+   so every entry is text */
+PyObject *trace_key(trace_entry *e) {
+  libcouchbase_size_t i, nkey = e->nkey < TRACE_KEY ? e->nkey : TRACE_KEY;
+  char escaped[TRACE_KEY * 4 + 1], *p = escaped;
+
+  for (i = 0; i < nkey; ++i) {
+    unsigned char c = e->key[i];
+    if (c >= ' ' && c < 0x7f && c != '\\')
+      *p++ = c;
+    else
+      p += sprintf(p, "\\x%02x", c);
+  }
+  return PyString_FromStringAndSize(escaped, p - escaped);
+}
+
+PyObject *trace_item(trace_entry *e, unsigned long long now, double wall) {
+  PyObject *key = trace_key(e), *flush = trace_phase(e, e->flush), *callback = trace_phase(e, e->callback);
+
+  if (!key || !flush || !callback) {
+    Py_XDECREF(key);
+    Py_XDECREF(flush);
+    Py_XDECREF(callback);
+    return 0;
+  }
+
+  return Py_BuildValue("{s:s,s:N,s:k,s:n,s:d,s:N,s:N,s:K,s:N}",
+		       "op", op_names[e->op], "key", key,
+		       "key_length", (unsigned long) e->nkey, "size", e->size,
+		       "submitted", wall - (now - e->submit) / 1e6, "flush_us", flush,
+		       "callback_us", callback, "deliver_us", e->deliver - e->submit,
+		       "timed_out", PyBool_FromLong(e->expired));
+}
+
+static PyObject *drain_trace(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  int peek = 0;
+
+  if (!PyArg_ParseTuple(args, "O|i", &cb, &peek))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  trace_log *l = &context->trace;
+  PyObject *r = PyList_New(0);
+  if (!r || !l->ring)
+    return r;
+
+  unsigned long long now = clock_usec(), read;
+  double wall = wall_clock();
+  for (read = l->read; read < l->written; ++read) {
+    PyObject *e = trace_item(&l->ring[read % l->size], now, wall);
+    if (!e || PyList_Append(r, e)) {
+      Py_XDECREF(e);
+      Py_DECREF(r);
+      return 0;
+    }
+    Py_DECREF(e);
+  }
+  if (!peek)
+    l->read = read;
+  return r;
+}
+
+/* forgets entries returned by a peeking drain_trace once they are kept */
+static PyObject *discard_trace(PyObject *self, PyObject *args) {
+  PyObject *cb;
+  unsigned long n;
+
+  if (!PyArg_ParseTuple(args, "Ok", &cb, &n))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  trace_log *l = &context->trace;
+  if (n > l->written - l->read)
+    n = l->written - l->read;
+  l->read += n;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *register_format(PyObject *self, PyObject *args) {
+  PyObject *cb, *encoder, *decoder, *k, *codec;
+  int format, r;
+
+  if (!PyArg_ParseTuple(args, "OiOO", &cb, &format, &encoder, &decoder))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  if (format < FMT_CUSTOM || format > FMT_MASK) {
+    PyErr_Format(Failure, "custom formats must be numbered from %d to %d", FMT_CUSTOM, FMT_MASK);
+    return 0;
+  }
+
+  if (!PyCallable_Check(encoder) || !PyCallable_Check(decoder)) {
+    PyErr_SetString(PyExc_TypeError, "encoder and decoder must be callable");
+    return 0;
+  }
+
+  if (!context->formats && !(context->formats = PyDict_New()))
+    return 0;
+
+  k = PyInt_FromLong(format);
+  codec = PyTuple_Pack(2, encoder, decoder);
+  r = k && codec ? PyDict_SetItem(context->formats, k, codec) : -1;
+  Py_XDECREF(k);
+  Py_XDECREF(codec);
+  if (r)
+    return 0;
+
+  Py_RETURN_NONE;
+}
+
+/* set and the other storage modes share one implementation. appended and
+   prepended bytes end up inside the stored value, so they are sent as they
+   are instead of being encoded or compressed */
+
+int encode_fragment(PyObject *value, PyObject **encoded, libcouchbase_uint32_t *flags) {
+  *flags = 0;
+  if (PyUnicode_Check(value))
+    *encoded = PyUnicode_AsUTF8String(value);
+  else if (PyString_Check(value)) {
+    Py_INCREF(value);
+    *encoded = value;
+  } else {
+    PyErr_SetString(PyExc_TypeError, "append and prepend take a string");
+    return -1;
+  } return *encoded ? 0 : -1;
+}
+
+int encode_store(pylibcb_instance *context,
+		 libcouchbase_storage_t operation,
+		 PyObject *value,
+		 int format,
+		 PyObject **encoded,
+		 libcouchbase_uint32_t *flags) {
+  if (operation == LIBCOUCHBASE_APPEND || operation == LIBCOUCHBASE_PREPEND) {
+    /* raw bytes added to a compressed item would make it undecodable, and
+       with compression on any item may be compressed */
+    if (context->compression) {
+      PyErr_Format(Failure, "%s cannot be used while compression is enabled", storage_names[operation]);
+      return -1;
+    }
+    return encode_fragment(value, encoded, flags);
+  }
+  return encode_value(context, value, format, encoded, flags);
+}
+
+PyObject *store_key(pylibcb_instance *context, libcouchbase_storage_t operation,
+		    const void *key, int nkey, PyObject *value, unsigned long _expiry,
+		    unsigned long cas, int format, PyObject *callback, int usec) {
+  PyObject *val;
+  libcouchbase_uint32_t flags;
+
+  ASYNC_GUARD();
+
+  if (check_callback(context, &callback))
+    return 0;
+
+  if (encode_store(context, operation, value, format, &val, &flags))
+    return 0;
+
+  time_t expiry = _expiry;
+  if (context->io.running) {
+    int failed = io_store(context, operation, key, nkey, val, flags, expiry, cas, usec);
+    Py_DECREF(val);
+    if (failed)
+      return 0;
+    Py_RETURN_NONE;
+  }
+
+  int *ticket = new_ticket(context);
+  if (!ticket) {
+    Py_DECREF(val);
+    return 0;
+  }
+  attach_callback(ticket, callback);
+  start_op(context, ticket, OP_SET, key, nkey, nkey + PyString_GET_SIZE(val));
+  near_written(context, key, nkey, 0);
+  wheel_add(context, ticket, usec);
+  track_store(ticket, operation, key, nkey, val, flags, expiry, cas);
+
+  libcouchbase_store_by_key(context->cb, hand_out_ticket(ticket), operation, 0, 0,
+			    key, nkey, PyString_AS_STRING(val), PyString_GET_SIZE(val), flags, expiry, cas);
+  Py_DECREF(val);
+  ASYNC_EXIT(ticket);
+
+  while (!context->timed_out && !context->succeeded && !context->exception && !context->internal_exception)
+    instance_wait(context);
+  INTERNAL_EXCEPTION_HANDLER(return 0);
+
+  if (context->exception)
+    return 0;
+
+  if (context->timed_out) {
+    PyErr_Format(Timeout, "timeout in %s", storage_names[operation]);
+    return 0;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject *store(PyObject *args, libcouchbase_storage_t operation) {
+  PyObject *cb, *value, *callback = 0;
+  void *key;
+  int nkey;
+  unsigned long _expiry = 0;
+  unsigned long cas = 0;
+  int format = FMT_AUTO;
+  int usec = 0;
+
+  if (!PyArg_ParseTuple(args, "Os#O|kkiOi", &cb, &key, &nkey, &value, &_expiry, &cas, &format, &callback, &usec))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  return store_key(context, operation, key, nkey, value, _expiry, cas, format, callback, usec);
+}
+
+static PyObject *set(PyObject *self, PyObject *args) {
+  return store(args, LIBCOUCHBASE_SET);
+}
+
+static PyObject *add(PyObject *self, PyObject *args) {
+  return store(args, LIBCOUCHBASE_ADD);
+}
+
+static PyObject *replace(PyObject *self, PyObject *args) {
+  return store(args, LIBCOUCHBASE_REPLACE);
+}
+
+static PyObject *append(PyObject *self, PyObject *args) {
+  return store(args, LIBCOUCHBASE_APPEND);
+}
+
+static PyObject *prepend(PyObject *self, PyObject *args) {
+  return store(args, LIBCOUCHBASE_PREPEND);
+}
+
+PyObject *remove_key(pylibcb_instance *context, const void *key, int nkey,
+		     unsigned long cas, PyObject *callback, int usec) {
+  ASYNC_GUARD();
+
+  if (check_callback(context, &callback))
+    return 0;
+
+  if (context->io.running) {
+    if (io_remove(context, key, nkey, cas, usec))
+      return 0;
+    Py_RETURN_NONE;
+  }
+
+  int *ticket = new_ticket(context);
+  if (!ticket)
+    return 0;
+  attach_callback(ticket, callback);
+  start_op(context, ticket, OP_REMOVE, key, nkey, nkey);
+  near_written(context, key, nkey, 0);
+  wheel_add(context, ticket, usec);
+  track_key(ticket, OP_REMOVE, key, nkey, 0, cas);
+
+  libcouchbase_remove_by_key(context->cb, hand_out_ticket(ticket), 0, 0, key, nkey, cas);
+  ASYNC_EXIT(ticket);
+
+  while (!context->timed_out && !context->succeeded && !context->exception && !context->internal_exception)
+    instance_wait(context);
+  INTERNAL_EXCEPTION_HANDLER(return 0);
+
+  if (context->exception)
+    return 0;
+
+  if (context->timed_out) {
+    PyErr_SetString(Timeout, "timeout in remove");
+    return 0;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *_remove(PyObject *self, PyObject *args) {
+  PyObject *cb, *callback = 0;
+  void *key;
+  int nkey;
+  unsigned long cas = 0;
+  int usec = 0;
+
+  if (!PyArg_ParseTuple(args, "Os#|kOi", &cb, &key, &nkey, &cas, &callback, &usec))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  return remove_key(context, key, nkey, cas, callback, usec);
+}
+
+PyObject *store_multi(PyObject *args, libcouchbase_storage_t operation) {
+  PyObject *cb, *values, *cas_map = 0;
+  PyObject *k, *v, *c, *val;
+  Py_ssize_t pos = 0;
+  unsigned long _expiry = 0;
+  int format = FMT_AUTO;
+  int usec = 0;
+  libcouchbase_uint32_t flags;
+
+  if (!PyArg_ParseTuple(args, "OO!|kOii", &cb, &PyDict_Type, &values, &_expiry, &cas_map, &format, &usec))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  if (cas_map == Py_None)
+    cas_map = 0;
+  if (cas_map && !PyDict_Check(cas_map)) {
+    PyErr_SetString(PyExc_TypeError, "cas map must be a dict");
+    return 0;
+  }
+
+  time_t expiry = _expiry;
+  int *ticket = begin_multi(context, values, usec, OP_SET);
+  if (!ticket)
+    return 0;
+
+  while (PyDict_Next(values, &pos, &k, &v)) {
+    char *key;
+    Py_ssize_t nkey;
+    unsigned long cas = 0;
+    int window;
+
+    if (PyString_AsStringAndSize(k, &key, &nkey) == -1)
+      goto abandon;
+
+    if (cas_map && (c = PyDict_GetItem(cas_map, k))) {
+      cas = PyInt_AsUnsignedLongMask(c);
+      if (PyErr_Occurred())
+	goto abandon;
+    }
+
+    if (encode_store(context, operation, v, format, &val, &flags))
+      goto abandon;
+
+    if ((window = multi_window(ticket))) {
+      Py_DECREF(val);
+      if (window < 0)
+	goto abandon;
+      break;
+    }
+
+    multi_submitted(ticket, nkey + PyString_GET_SIZE(val));
+    near_written(context, key, nkey, 0);
+    track_store(ticket, operation, key, nkey, val, flags, expiry, cas);
+    libcouchbase_store_by_key(context->cb, ticket, operation, 0, 0,
+			      key, nkey, PyString_AS_STRING(val), PyString_GET_SIZE(val), flags, expiry, cas);
+    Py_DECREF(val);
+  }
+
+  return end_multi(ticket);
+
+ abandon:
+  abandon_multi(ticket);
+  return 0;
+}
+
+static PyObject *set_multi(PyObject *self, PyObject *args) {
+  return store_multi(args, LIBCOUCHBASE_SET);
+}
+
+static PyObject *add_multi(PyObject *self, PyObject *args) {
+  return store_multi(args, LIBCOUCHBASE_ADD);
+}
+
+static PyObject *replace_multi(PyObject *self, PyObject *args) {
+  return store_multi(args, LIBCOUCHBASE_REPLACE);
+}
+
+static PyObject *append_multi(PyObject *self, PyObject *args) {
+  return store_multi(args, LIBCOUCHBASE_APPEND);
+}
+
+static PyObject *prepend_multi(PyObject *self, PyObject *args) {
+  return store_multi(args, LIBCOUCHBASE_PREPEND);
+}
+
+static PyObject *remove_multi(PyObject *self, PyObject *args) {
+  PyObject *cb, *keys, *seq;
+  Py_ssize_t i, n;
+  int usec = 0, window = 0;
+
+  if (!PyArg_ParseTuple(args, "OO|i", &cb, &keys, &usec))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  seq = PySequence_Fast(keys, "keys must be a sequence");
+  if (!seq)
+    return 0;
+
+  int *ticket = begin_multi(context, seq, usec, OP_REMOVE);
+  if (!ticket) {
+    Py_DECREF(seq);
+    return 0;
+  }
+
+  n = PySequence_Fast_GET_SIZE(seq);
+  for (i = 0; i < n; ++i) {
+    char *key;
+    Py_ssize_t nkey;
+
+    if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(seq, i), &key, &nkey) == -1
+	|| (window = multi_window(ticket)) < 0) {
+      Py_DECREF(seq);
+      abandon_multi(ticket);
+      return 0;
+    }
+    if (window)
+      break;
+
+    multi_submitted(ticket, nkey);
+    near_written(context, key, nkey, 0);
+    track_key(ticket, OP_REMOVE, key, nkey, 0, 0);
+    libcouchbase_remove_by_key(context->cb, ticket, 0, 0, key, nkey, 0);
+  }
+
+  Py_DECREF(seq);
+  return end_multi(ticket);
+}
+
+static PyObject *arithmetic(PyObject *self, PyObject *args) {
+  PyObject *cb, *callback = 0;
+  void *key;
+  int nkey;
+  long long delta;
+  unsigned long long initial = 0;
+  int create = 0;
+  unsigned long _expiry = 0;
+  int usec = 0;
+
+  if (!PyArg_ParseTuple(args, "Os#L|KikOi", &cb, &key, &nkey, &delta, &initial, &create, &_expiry, &callback, &usec))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  ASYNC_GUARD();
+
+  if (check_callback(context, &callback))
+    return 0;
+
+  if (context->io.running)
+    return io_arithmetic(context, key, nkey, delta, initial, create, _expiry, usec);
+
+  int *ticket = new_ticket(context);
+  if (!ticket)
+    return 0;
+  attach_callback(ticket, callback);
+  start_op(context, ticket, OP_ARITHMETIC, key, nkey, nkey);
+  wheel_add(context, ticket, usec);
+  near_written(context, key, nkey, 0);
+  track_arithmetic(ticket, key, nkey, delta, _expiry, create, initial);
+
+  libcouchbase_arithmetic_by_key(context->cb, hand_out_ticket(ticket), 0, 0, key, nkey, delta, _expiry, create, initial);
+  ASYNC_EXIT(ticket);
+
+  while (!context->timed_out && !context->succeeded && !context->exception && !context->internal_exception)
+    instance_wait(context);
+  INTERNAL_EXCEPTION_HANDLER(return 0);
+
+  if (context->exception)
+    return 0;
+
+  if (context->timed_out) {
+    PyErr_SetString(Timeout, "timeout in arithmetic");
+    return 0;
+  }
+
+  return context->returned_value;
+}
+
+static PyObject *arithmetic_multi(PyObject *self, PyObject *args) {
+  PyObject *cb, *deltas, *k, *v;
+  Py_ssize_t pos = 0;
+  unsigned long long initial = 0;
+  int create = 0;
+  unsigned long _expiry = 0;
+  int usec = 0, window;
+
+  if (!PyArg_ParseTuple(args, "OO!|Kiki", &cb, &PyDict_Type, &deltas, &initial, &create, &_expiry, &usec))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  int *ticket = begin_multi(context, deltas, usec, OP_ARITHMETIC);
+  if (!ticket)
+    return 0;
+
+  while (PyDict_Next(deltas, &pos, &k, &v)) {
+    char *key;
+    Py_ssize_t nkey;
+    long long delta;
+
+    if (PyString_AsStringAndSize(k, &key, &nkey) == -1)
+      goto abandon;
+
+    delta = PyLong_AsLongLong(v);
+    if (delta == -1 && PyErr_Occurred())
+      goto abandon;
+
+    if ((window = multi_window(ticket))) {
+      if (window < 0)
+	goto abandon;
+      break;
+    }
+
+    multi_submitted(ticket, nkey);
+    near_written(context, key, nkey, 0);
+    track_arithmetic(ticket, key, nkey, delta, _expiry, create, initial);
+    libcouchbase_arithmetic_by_key(context->cb, ticket, 0, 0, key, nkey, delta, _expiry, create, initial);
+  }
+
+  return end_multi(ticket);
+
+ abandon:
+  abandon_multi(ticket);
+  return 0;
+}
+
+/* bulk jobs use one ticket like the multi operations, but results only
+   update the job's counters. they run in sync mode only */
+
+int *begin_bulk(pylibcb_instance *context, int window, Py_ssize_t max_failures, int op) {
+  IO_THREAD_GUARD("bulk jobs");
+
+  if (context->async_mode) {
+    PyErr_SetString(Failure, "bulk jobs are not available in async mode");
+    return 0;
+  }
+
+  int *_ticket = new_ticket(context);
+  if (!_ticket)
+    return 0;
+
+  ticket *_t = (ticket *) _ticket;
+  _t->bulk = calloc(1, sizeof(bulk_job));
+  if (!_t->bulk || !(_t->bulk->failures = PyDict_New())) {
+    if (!_t->bulk)
+      PyErr_NoMemory();
+    rip_ticket(hand_out_ticket(_ticket));
+    return 0;
+  }
+  _t->bulk->window = window;
+  _t->bulk->max_failures = max_failures;
+  _t->pending = 1;
+  _t->submitting = 1;
+
+  mark_op(_ticket, op);
+  return hand_out_ticket(_ticket);
+}
+
+/* waits for the rest of the job, the caller still holds the ticket */
+int finish_bulk(int *_ticket) {
+  ticket *_t = (ticket *) _ticket;
+  pylibcb_instance *context = _t->instance;
+
+  _t->submitting = 0;
+  if (!--_t->pending)
+    complete_op(_t);
+
+  while (_t->pending && !context->internal_exception && !context->exception)
+    instance_wait(context);
+
+  return context->internal_exception || context->exception ? -1 : 0;
+}
+
+PyObject *bulk_summary(bulk_job *b, const char *done, unsigned long long start) {
+  double seconds = (clock_usec() - start) / 1e6;
+  double rate = seconds > 0 ? 1 / seconds : 0;
+
+  return Py_BuildValue("{s:K,s:K,s:O,s:K,s:d,s:d,s:d}",
+		       done, b->done,
+		       "failed", b->failed,
+		       "failures", b->failures,
+		       "bytes", b->bytes,
+		       "seconds", seconds,
+		       "per_second", (b->done + b->failed) * rate,
+		       "mb_per_second", b->bytes * rate / (1 << 20));
+}
+
+/* just enough json to find a top level string member of an object
+   without decoding the line. members with escapes in them are not
+   supported as keys */
+
+const char *json_space(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    ++p;
+  return p;
+}
+
+/* p is at the opening quote, returns the position after the closing one */
+const char *json_string(const char *p, const char *end) {
+  for (++p; p < end; ++p) {
+    if (*p == '\\')
+      ++p;
+    else if (*p == '"')
+      return p + 1;
+  } return 0;
+}
+
+const char *json_skip(const char *p, const char *end) {
+  int depth = 0;
+
+  while (p < end) {
+    switch (*p) {
+    case '"':
+      if (!(p = json_string(p, end)))
+	return 0;
+      if (!depth)
+	return p;
+      continue;
+    case '{':
+    case '[':
+      ++depth;
+      break;
+    case '}':
+    case ']':
+      if (!depth)
+	return p;
+      if (!--depth)
+	return p + 1;
+      break;
+    case ',':
+      if (!depth)
+	return p;
+      break;
+    }
+    ++p;
+  } return depth ? 0 : p;
+}
+
+int json_member(const char *p, const char *end, const char *name, size_t nname,
+		const char **value, size_t *nvalue) {
+  const char *s;
+
+  p = json_space(p, end);
+  if (p == end || *p++ != '{')
+    return -1;
+
+  for (;;) {
+    p = json_space(p, end);
+    if (p < end && *p == '}')
+      return 0;
+    if (p == end || *p != '"' || !(s = json_string(p, end)))
+      return -1;
+
+    int match = s - p - 2 == nname && !memcmp(p + 1, name, nname);
+    p = json_space(s, end);
+    if (p == end || *p++ != ':')
+      return -1;
+    p = json_space(p, end);
+
+    if (match) {
+      if (p == end || *p != '"' || !(s = json_string(p, end)))
+	return -1;
+      *value = p + 1;
+      *nvalue = s - p - 2;
+      return memchr(*value, '\\', *nvalue) || !*nvalue ? -1 : 1;
+    }
+
+    if (!(p = json_skip(p, end)))
+      return -1;
+    p = json_space(p, end);
+    if (p < end && *p == ',')
+      ++p;
+    else if (p == end || *p != '}')
+      return -1;
+  }
+}
+
+/* maps a whole file read only, an empty file maps to 0 */
+int map_file(const char *path, char **map, size_t *size) {
+  struct stat st;
+  FILE *f;
+
+  *map = 0;
+  *size = 0;
+  if (!(f = fopen(path, "rb")) || fstat(fileno(f), &st) == -1) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+    if (f)
+      fclose(f);
+    return -1;
+  }
+
+  if (st.st_size) {
+    *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (*map == MAP_FAILED) {
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+      *map = 0;
+      fclose(f);
+      return -1;
+    }
+    *size = st.st_size;
+    madvise(*map, *size, MADV_SEQUENTIAL);
+  }
+
+  fclose(f);
+  return 0;
+}
+
+#define LOAD_TSV 0
+#define LOAD_JSON 1
+
+/* returns 1 with the key and value of a record, 0 for blank lines and -1
+   for lines that could not be parsed */
+int load_record(int format, const char *key_field, size_t nkey_field,
+		const char *line, const char *end,
+		const char **key, size_t *nkey, const char **value, size_t *nvalue) {
+  const char *tab;
+
+  if (end > line && end[-1] == '\r')
+    --end;
+  if (json_space(line, end) == end)
+    return 0;
+
+  if (format == LOAD_JSON) {
+    *value = line;
+    *nvalue = end - line;
+    return json_member(line, end, key_field, nkey_field, key, nkey) == 1 ? 1 : -1;
+  }
+
+  if (!(tab = memchr(line, '\t', end - line)) || tab == line)
+    return -1;
+  *key = line;
+  *nkey = tab - line;
+  *value = tab + 1;
+  *nvalue = end - tab - 1;
+  return 1;
+}
+
+static PyObject *load_file(PyObject *self, PyObject *args) {
+  PyObject *cb, *bad_lines = 0, *r = 0;
+  const char *path, *format_name, *key_field = "_id";
+  unsigned long _expiry = 0;
+  int window = 0, max_failures = 1000;
+  int format, expired, *ticket;
+  bulk_job *job;
+  char *map;
+  size_t size;
+  unsigned long long start = clock_usec(), lineno = 0, malformed = 0;
+
+  if (!PyArg_ParseTuple(args, "Oss|kiis", &cb, &path, &format_name, &_expiry, &window, &max_failures, &key_field))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  if (!strcmp(format_name, "tsv"))
+    format = LOAD_TSV;
+  else if (!strcmp(format_name, "jsonl"))
+    format = LOAD_JSON;
+  else {
+    PyErr_SetString(PyExc_ValueError, "format must be 'tsv' or 'jsonl'");
+    return 0;
+  }
+
+  if (map_file(path, &map, &size))
+    return 0;
+
+  libcouchbase_uint32_t flags = format == LOAD_JSON ? FMT_JSON : FMT_BYTES;
+  size_t nkey_field = strlen(key_field);
+  time_t expiry = _expiry;
+  const char *p = map, *end = map + size, *eol;
+
+  if (!(bad_lines = PyList_New(0)))
+    goto done;
+  if (!(ticket = begin_bulk(context, window, max_failures, OP_SET)))
+    goto done;
+  job = ((struct t_ticket *) ticket)->bulk;
+
+  /* values go to libcouchbase straight from the mapping, which copies
+     them into its output buffers before the store call returns */
+  for (; p < end; p = eol + 1) {
+    const char *key, *value;
+    size_t nkey, nvalue;
+    int record;
+
+    if (!(eol = memchr(p, '\n', end - p)))
+      eol = end;
+    ++lineno;
+
+    record = load_record(format, key_field, nkey_field, p, eol, &key, &nkey, &value, &nvalue);
+    if (!record)
+      continue;
+    if (record < 0) {
+      ++malformed;
+      if (PyList_GET_SIZE(bad_lines) < max_failures) {
+	PyObject *n = PyLong_FromUnsignedLongLong(lineno);
+	if (!n || PyList_Append(bad_lines, n)) {
+	  Py_XDECREF(n);
+	  goto abandon;
+	}
+	Py_DECREF(n);
+      }
+      continue;
+    }
+
+    if ((expired = multi_window(ticket))) {
+      if (expired < 0)
+	goto abandon;
+      break;
+    }
+
+    multi_submitted(ticket, nkey + nvalue);
+    job->bytes += nvalue;
+    near_written(context, key, nkey, 0);
+    coalesce_written(context, key, nkey);
+    libcouchbase_store_by_key(context->cb, ticket, LIBCOUCHBASE_SET, 0, 0,
+			      key, nkey, value, nvalue, flags, expiry, 0);
+  }
+
+  if (!finish_bulk(ticket) && (r = bulk_summary(job, "stored", start))) {
+    PyObject *extra = Py_BuildValue("{s:K,s:O}", "malformed", malformed, "bad_lines", bad_lines);
+    if (!extra || PyDict_Update(r, extra)) {
+      Py_DECREF(r);
+      r = 0;
+    }
+    Py_XDECREF(extra);
+  }
+  rip_ticket(ticket);
+  arena_reset(&context->arena);
+  goto done;
+
+ abandon:
+  abandon_multi(ticket);
+
+ done:
+  Py_XDECREF(bad_lines);
+  if (map)
+    munmap(map, size);
+  return r;
+}
+
+/* keys are sent in mgets of up to EXPORT_BATCH, keys taken from an
+   iterable are held until their batch is sent */
+
+#define EXPORT_BATCH 64
+
+typedef struct t_export_batch {
+  int n;
+  const void *keys[EXPORT_BATCH];
+  libcouchbase_size_t nkeys[EXPORT_BATCH];
+  PyObject *held[EXPORT_BATCH];
+} export_batch;
+
+void export_release(export_batch *b) {
+  int i;
+  for (i = 0; i < b->n; ++i)
+    Py_XDECREF(b->held[i]);
+  b->n = 0;
+}
+
+int export_flush(int *_ticket, export_batch *b) {
+  ticket *_t = (ticket *) _ticket;
+  pylibcb_instance *context = _t->instance;
+  int limit = _t->bulk->window ? _t->bulk->window : context->async_limit;
+  int i, r = 0;
+
+  /* a batch larger than the window waits until nothing is in flight */
+  while (b->n && _t->pending > 1 && _t->pending - 1 + b->n > limit) {
+    instance_loop_once(context);
+    if (context->internal_exception || context->exception) {
+      r = -1;
+      goto release;
+    }
+  }
+
+  if (b->n) {
+    for (i = 0; i < b->n; ++i) {
+      multi_submitted(_ticket, b->nkeys[i]);
+      track_key(_ticket, OP_GET, b->keys[i], b->nkeys[i], 0, 0);
+    }
+    libcouchbase_mget_by_key(context->cb, _ticket, 0, 0, b->n, b->keys, b->nkeys, 0);
+  }
+
+ release:
+  export_release(b);
+  return r;
+}
+
+int export_key(int *_ticket, export_batch *b, const void *key, libcouchbase_size_t nkey, PyObject *held) {
+  b->keys[b->n] = key;
+  b->nkeys[b->n] = nkey;
+  b->held[b->n] = held;
+  return ++b->n == EXPORT_BATCH ? export_flush(_ticket, b) : 0;
+}
+
+/* keys come from a file of one key per line, which is memory mapped, or
+   from any iterable of strings */
+
+static PyObject *export_keys(PyObject *self, PyObject *args) {
+  PyObject *cb, *keys, *iter = 0, *k, *r = 0;
+  const char *out_path, *errors_path = 0;
+  int window = 0, max_failures = 1000, *ticket = 0;
+  FILE *out = 0, *errors = 0;
+  char *map = 0;
+  size_t size = 0;
+  bulk_job *job;
+  export_batch batch;
+  unsigned long long start = clock_usec();
+
+  if (!PyArg_ParseTuple(args, "OOs|zii", &cb, &keys, &out_path, &errors_path, &window, &max_failures))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  if (PyString_Check(keys)) {
+    if (map_file(PyString_AS_STRING(keys), &map, &size))
+      return 0;
+  } else if (!(iter = PyObject_GetIter(keys)))
+    return 0;
+
+  if (!(out = fopen(out_path, "wb"))) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) out_path);
+    goto done;
+  }
+  if (errors_path && !(errors = fopen(errors_path, "wb"))) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) errors_path);
+    goto done;
+  }
+  setvbuf(out, 0, _IOFBF, 1 << 20);
+
+  if (!(ticket = begin_bulk(context, window, max_failures, OP_GET)))
+    goto done;
+  job = ((struct t_ticket *) ticket)->bulk;
+  /* the job closes the files once every response is in */
+  job->out = out;
+  job->errors = errors;
+  out = errors = 0;
+  batch.n = 0;
+
+  if (map) {
+    const char *p = map, *end = map + size, *eol, *e;
+
+    for (; p < end; p = eol + 1) {
+      if (!(eol = memchr(p, '\n', end - p)))
+	eol = end;
+      e = eol;
+      if (e > p && e[-1] == '\r')
+	--e;
+      if (e > p && export_key(ticket, &batch, p, e - p, 0))
+	goto abandon;
+    }
+  } else {
+    while ((k = PyIter_Next(iter))) {
+      if (!PyString_Check(k)) {
+	Py_DECREF(k);
+	PyErr_SetString(PyExc_TypeError, "keys must be strings");
+	goto abandon;
+      }
+      if (export_key(ticket, &batch, PyString_AS_STRING(k), PyString_GET_SIZE(k), k))
+	goto abandon;
+    }
+    if (PyErr_Occurred())
+      goto abandon;
+  }
+
+  if (export_flush(ticket, &batch) || finish_bulk(ticket)) {
+    rip_ticket(ticket);
+    goto done;
+  }
+
+  if (!job->write_error && (fflush(job->out) || (job->errors && fflush(job->errors))))
+    job->write_error = errno ? errno : EIO;
+  if (job->write_error) {
+    errno = job->write_error;
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) out_path);
+  } else if ((r = bulk_summary(job, "exported", start))) {
+    PyObject *missing = PyLong_FromUnsignedLongLong(job->missing);
+    if (!missing || PyDict_SetItemString(r, "missing", missing)) {
+      Py_DECREF(r);
+      r = 0;
+    }
+    Py_XDECREF(missing);
+  }
+  rip_ticket(ticket);
+  arena_reset(&context->arena);
+  goto done;
+
+ abandon:
+  export_release(&batch);
+  abandon_multi(ticket);
+
+ done:
+  Py_XDECREF(iter);
+  if (out)
+    fclose(out);
+  if (errors)
+    fclose(errors);
+  if (map)
+    munmap(map, size);
+  return r;
+}
+
+/* an async get waiting for the response to an earlier one of its key */
+PyObject *coalesce_join(pylibcb_instance *context, struct t_ticket *leader,
+			const void *key, libcouchbase_size_t nkey, int usec, PyObject *callback) {
+  int *ticket = new_ticket(context);
+  if (!ticket)
+    return 0;
+  attach_callback(ticket, callback);
+  start_op(context, ticket, OP_GET, key, nkey, 0);
+  wheel_add(context, ticket, usec);
+
+  /* the leader's list holds a reference until the response is handed out */
+  ((struct t_ticket *) ticket)->follower_next = leader->followers;
+  leader->followers = (struct t_ticket *) hand_out_ticket(ticket);
+  ++context->stats.coalesced;
+
+  ++context->async_count;
+  return Py_BuildValue("i", ticket[0]);
+}
+
+PyObject *get_key(pylibcb_instance *context, const void *key, int _nkey,
+		  int usec, unsigned long _expiry, int return_cas, PyObject *callback) {
+  ASYNC_GUARD();
+
+  if (check_callback(context, &callback))
+    return 0;
+
+  libcouchbase_size_t nkey = _nkey;
+  time_t expiry = _expiry;
+
+  /* near cache hits complete without a ticket or the event loop, except
+     that async results still need a ticket to be delivered under */
+  if (context->near.buckets && !_expiry) {
+    PyObject *v;
+    libcouchbase_cas_t cas;
+    int hit = near_lookup(context, key, nkey, &v, &cas);
+
+    if (hit < 0)
+      return 0;
+    if (hit && context->async_mode) {
+      int *ticket = new_ticket(context);
+      if (!ticket) {
+	Py_DECREF(v);
+	return 0;
+      }
+      attach_callback(ticket, callback);
+      hand_out_ticket(ticket);
+      async_deliver(context, (struct t_ticket *) ticket, Py_BuildValue("(Nk)", v, (unsigned long) cas));
+      PyObject *r = Py_BuildValue("i", ticket[0]);
+      rip_ticket(ticket);
+      return r;
+    }
+    if (hit)
+      return return_cas ? Py_BuildValue("Nk", v, (unsigned long) cas) : v;
+  }
+
+  if (context->io.running)
+    return io_get(context, key, nkey, expiry, return_cas, usec);
+
+  int coalesce = context->async_mode && !_expiry && context->coalesce.enabled;
+  unsigned int hash = 0;
+  if (coalesce) {
+    hash = near_hash(key, nkey);
+    inflight *e = coalesce_find(&context->coalesce, key, nkey, hash);
+    if (e)
+      return coalesce_join(context, e->leader, key, nkey, usec, callback);
+  }
+
+  int *ticket = new_ticket(context);
+  if (!ticket)
+    return 0;
+  attach_callback(ticket, callback);
+  start_op(context, ticket, _expiry ? OP_GAT : OP_GET, key, nkey, nkey);
+  wheel_add(context, ticket, usec);
+  track_key(ticket, _expiry ? OP_GAT : OP_GET, key, nkey, expiry, 0);
+  if (coalesce) {
+    ++context->stats.coalesce_sent;
+    coalesce_add(&context->coalesce, (struct t_ticket *) ticket, key, nkey, hash);
+  }
+
+  libcouchbase_mget_by_key(context->cb, hand_out_ticket(ticket), 0, 0, 1, &key, &nkey, _expiry ? &expiry : 0);
+  ASYNC_EXIT(ticket);
+
+  while (!context->timed_out && !context->succeeded && !context->exception && !context->internal_exception)
+    instance_wait(context);
+  INTERNAL_EXCEPTION_HANDLER(return 0);
+
+  if (context->exception)
+    return 0;
+  
+  if (context->timed_out) {
+    PyErr_SetString(Timeout, "timeout in get");
+    return 0;
+  }
+
+  if (!context->succeeded) {
+    PyErr_SetString(Failure, "no timeout.. AND no success?");
+    return 0;
+  }
+
+  if (context->result == LIBCOUCHBASE_KEY_ENOENT)
+    Py_RETURN_NONE;
+
+  if (return_cas)
+    return Py_BuildValue("Nk", context->returned_value, (unsigned long) context->returned_cas);
+  return context->returned_value;
+}
+
+static PyObject *get(PyObject *self, PyObject *args) {
+  PyObject *cb, *callback = 0;
+  const void *key;
+  int nkey;
+  int usec = 0;
+  unsigned long _expiry = 0;
+  int return_cas = 0;
+  
+  if (!PyArg_ParseTuple(args, "Os#|ikiO", &cb, &key, &nkey, &usec, &_expiry, &return_cas, &callback))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  return get_key(context, key, nkey, usec, _expiry, return_cas, callback);
+}
+
+static PyObject *get_multi(PyObject *self, PyObject *args) {
+  PyObject *cb, *keys, *seq;
+  int usec = 0;
+  unsigned long _expiry = 0;
+  int return_cas = 0;
+
+  if (!PyArg_ParseTuple(args, "OO|iki", &cb, &keys, &usec, &_expiry, &return_cas))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
+    return 0;
+
+  ASYNC_GUARD();
+  IO_THREAD_GUARD("get_multi");
 
-  if (!PyArg_ParseTuple(args, "|ssss", &host, &user, &passwd, &bucket))
+  seq = PySequence_Fast(keys, "keys must be a sequence");
+  if (!seq)
     return 0;
 
-  if (!strlen(host))
-    host = 0;
-  if (!strlen(user))
-    user = 0;
-  if (!strlen(passwd))
-    passwd = 0;
-  if (!strlen(bucket))
-    passwd = 0;
+  Py_ssize_t i, n = PySequence_Fast_GET_SIZE(seq);
+  if (context->async_mode && async_backpressure(context, n)) {
+    Py_DECREF(seq);
+    return 0;
+  }
 
-  pylibcb_instance *z = calloc(1, sizeof(pylibcb_instance));
-  if (!z) {
-    PyErr_SetString(OutOfMemory, "ran out of memory while allocating pylibcb instance");
+  /* key pointers, key lengths and per key expiry times share one block */
+  void *block = malloc(n * (sizeof(void *) + sizeof(libcouchbase_size_t) + sizeof(libcouchbase_time_t)) + 1);
+  if (!block) {
+    Py_DECREF(seq);
+    PyErr_SetString(OutOfMemory, "ran out of memory while allocating key list");
     return 0;
   }
 
-  z->ticket_slabs = new_ticket_slab(0);
-  z->event_slabs = new_event_slab(0);
-  if (!z->ticket_slabs || !z->event_slabs) {
-    PyErr_SetString(OutOfMemory, "ran out of memory while allocating pylibcb instance");
-    goto free_instance;
+  const void **k = block;
+  libcouchbase_size_t *nk = (void *) (k + n);
+  libcouchbase_time_t *expiry = (void *) (nk + n);
+  Py_ssize_t sent = 0, m = 0;
+  PyObject *found = PyDict_New();
+  if (!found) {
+    free(block);
+    Py_DECREF(seq);
+    return 0;
   }
 
-  z->base = event_base_new();
-  if (!z) {
-    PyErr_SetString(OutOfMemory, "could not create event base for new instance");
-    goto free_instance;
+  /* keys found in the near cache go straight into the result */
+  for (i = 0; i < n; ++i) {
+    PyObject *key = PySequence_Fast_GET_ITEM(seq, i);
+    char *s;
+    Py_ssize_t ns;
+
+    if (PyString_AsStringAndSize(key, &s, &ns) == -1)
+      goto fail;
+
+    if (context->near.buckets && !_expiry) {
+      PyObject *v;
+      libcouchbase_cas_t cas;
+      int hit = near_lookup(context, s, ns, &v, &cas);
+
+      if (hit && return_cas)
+	v = Py_BuildValue("(Nk)", v, (unsigned long) cas);
+      if (hit && (!v || PyDict_SetItem(found, key, v))) {
+	Py_XDECREF(v);
+	hit = -1;
+      }
+      if (hit < 0)
+	goto fail;
+      if (hit) {
+	Py_DECREF(v);
+	continue;
+      }
+    }
+
+    k[m] = s;
+    nk[m] = ns;
+    expiry[m] = _expiry;
+    sent += ns;
+    ++m;
   }
+  n = m;
 
-  libcouchbase_error_t e = LIBCOUCHBASE_SUCCESS;
-  libcouchbase_io_opt_t *cb_base = libcouchbase_create_io_ops(LIBCOUCHBASE_IO_OPS_LIBEVENT, z->base, &e);
-  if (e == LIBCOUCHBASE_NOT_SUPPORTED) {
-    PyErr_SetString(Failure, "libcouchbase as built on this platform does not support libevent ?");
-    goto free_event_base;
-  } else if (e == LIBCOUCHBASE_ENOMEM) {
-    PyErr_SetString(OutOfMemory, "ran out of memory while setting up libcouchbase event loop");
-    goto free_event_base;
-  } else if (e == LIBCOUCHBASE_ERROR) {
-    PyErr_SetString(Failure, "a failure occurred while setting up libcouchbase event loop (probably couldn't locate libcouchbase_event shared library)");
-    goto free_event_base;
-    return 0;
-  } else if (e != LIBCOUCHBASE_SUCCESS) {
-    PyErr_SetString(Failure, "an unhandled error condition occurred when calling libcouchbase_create_io_ops");
-    goto free_event_base;
+  int *ticket = new_ticket(context);
+  if (!ticket)
+    goto fail;
+
+  struct t_ticket *_t = (struct t_ticket *) ticket;
+  _t->multi = found;
+  _t->return_cas = return_cas;
+  _t->pending = n;
+
+  PyObject *r = 0;
+  if (!n) {
+    free(block);
+    Py_DECREF(seq);
+    if (context->async_mode) {
+      Py_INCREF(_t->multi);
+      async_deliver(context, _t, _t->multi);
+      r = Py_BuildValue("i", ticket[0]);
+    } else {
+      r = _t->multi;
+      Py_INCREF(r);
+    }
+    rip_ticket(hand_out_ticket(ticket));
+    return r;
   }
-  
-  z->cb = libcouchbase_create(host, user, passwd, bucket, cb_base);
-  if (!z->cb) {
-    /* unsure what to do with libcouchbase_io_ops_t created in last step */
-    PyErr_SetString(OutOfMemory, "could not create libcouchbase instance");
-    goto free_event_base;
+
+  if (usec && !(_t->keys = PySequence_Tuple(seq))) {
+    free(block);
+    Py_DECREF(seq);
+    rip_ticket(hand_out_ticket(ticket));
+    return 0;
   }
+  wheel_add(context, ticket, usec);
 
-  context = z;
-  libcouchbase_set_error_callback(z->cb, (libcouchbase_error_callback) error_callback);
-  libcouchbase_set_storage_callback(z->cb, (libcouchbase_storage_callback) set_callback);
-  libcouchbase_set_get_callback(z->cb, (libcouchbase_get_callback) get_callback);
-  libcouchbase_set_remove_callback(z->cb, (libcouchbase_remove_callback) remove_callback);
-  
-  default_error_string = "libcouchbase_connect";
-  default_exception = ConnectionFailure;
+  mark_op(ticket, _expiry ? OP_GAT : OP_GET);
+  context->stats.ops[_t->op] += n;
+  context->stats.bytes_sent += sent;
 
-  if (libcouchbase_connect(z->cb) != LIBCOUCHBASE_SUCCESS) {
-    goto free_event_base;
+  /* one reference for each key's callback */
+  for (i = 0; i < n; ++i) {
+    hand_out_ticket(ticket);
+    track_key(ticket, _t->op, k[i], nk[i], _expiry, 0);
   }
 
-  /* establish connection */
-  libcouchbase_wait(z->cb);
-  if (z->internal_exception) {
-    goto free_event_base;
+  libcouchbase_mget_by_key(context->cb, ticket, 0, 0, n, k, nk, _expiry ? expiry : 0);
+  free(block);
+  Py_DECREF(seq);
+
+  if (context->async_mode) {
+    context->async_count += n;
+    return Py_BuildValue("i", ticket[0]);
   }
 
-  default_error_string = "internal exception";
-  default_exception = Failure;
+  /* hold on to the ticket (and its result dict) until we are done with it */
+  hand_out_ticket(ticket);
 
-  z->async_limit = 20; /* maximum number of async events that may be queued up on the event loop */
+  /* at the deadline keys still missing are given Timeout instances, like
+     the other batches */
+  while (_t->pending && !context->exception && !context->internal_exception)
+    instance_wait(context);
 
-  return PyCObject_FromVoidPtrAndDesc(z, pylibcb_instance_desc, pylibcb_instance_dest);
+  if (!context->internal_exception && !context->exception) {
+    r = _t->multi;
+    Py_INCREF(r);
+  }
 
- free_event_base:
-  free(z->base);
- free_instance:
-  if (z->ticket_slabs)
-    destroy_ticket_slab(z->ticket_slabs);
-  if (z->event_slabs)
-    destroy_event_slab(z->event_slabs);
+  rip_ticket(ticket);
+  return r;
 
-  free(z);
-  default_error_string = "internal exception";
-  default_exception = Failure;
+ fail:
+  free(block);
+  Py_DECREF(seq);
+  Py_DECREF(found);
   return 0;
 }
 
-int pyobject_is_pylibcb_instance(PyObject *x) {
-  if (!PyCObject_Check(x)
-      || memcmp(PyCObject_GetDesc(x), pylibcb_instance_desc, sizeof("pylibcb_instance"))) {
-    PyErr_SetString(Failure, "need pylibcb instance as first argument");
-    return 0;
-  } return 1;
+int connection_init(PyObject *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = { "host", "user", "password", "bucket", "timeout", "io_thread", 0 };
+  pylibcb_connection *c = (pylibcb_connection *) self;
+  char *host = "localhost", *user = "", *passwd = "", *bucket = "default";
+  double timeout = 0;
+  int io_thread = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ssssdi:Connection", kwlist,
+				   &host, &user, &passwd, &bucket, &timeout, &io_thread))
+    return -1;
+
+  PyObject *open_args = Py_BuildValue("(ssssii)", host, user, passwd, bucket, 0, io_thread);
+  if (!open_args)
+    return -1;
+  PyObject *handle = open(0, open_args);
+  Py_DECREF(open_args);
+  if (!handle)
+    return -1;
+
+  Py_XDECREF(c->handle);
+  c->handle = handle;
+  c->context = PyCObject_AsVoidPtr(handle);
+  c->timeout = (unsigned int) (timeout * 1000);
+  return 0;
 }
 
-void set_context(PyObject *x) {
-  context = PyCObject_AsVoidPtr(x);
-  context->succeeded = 0;
-  context->timed_out = 0;
-  context->exception = 0;
-  context->internal_exception = 0;
+void connection_dealloc(PyObject *self) {
+  Py_XDECREF(((pylibcb_connection *) self)->handle);
+  Py_TYPE(self)->tp_free(self);
 }
 
-int *new_ticket() {
-  int *t = alloc_ticket();
-  if (!t) {
-    PyErr_SetString(OutOfMemory, "ran out of memory for new callback tracking tickets");
-    return 0;
-  } return t;
+PyObject *connection_instance(PyObject *self, void *closure) {
+  Py_INCREF(self);
+  return self;
 }
 
-static PyObject *get_async_limit(PyObject *self, PyObject *args) {
-  PyObject *cb;
-  
-  if (!PyArg_ParseTuple(args, "O", &cb))
+int connection_key(PyObject *k, const char **key, int *nkey) {
+  if (PyString_CheckExact(k)) {
+    *key = PyString_AS_STRING(k);
+    *nkey = PyString_GET_SIZE(k);
     return 0;
+  } return PyArg_Parse(k, "s#", key, nkey) ? 0 : -1;
+}
 
-  set_context(cb);
+/* timeouts are given in milliseconds, 0 or None picks the default */
+int connection_usec(pylibcb_connection *c, PyObject *timeout, int *usec) {
+  double ms = 0;
 
-  return PyInt_FromLong(context->async_limit);
+  if (timeout && timeout != Py_None) {
+    ms = PyFloat_AsDouble(timeout);
+    if (ms == -1 && PyErr_Occurred())
+      return -1;
+  }
+  *usec = (int) (ms * 1000);
+  if (!*usec)
+    *usec = c->timeout;
+  return 0;
 }
 
-static PyObject *set_async_limit(PyObject *self, PyObject *args) {
-  PyObject *cb;
-  int limit;
+PyObject *connection_fetch(PyObject *self, PyObject *args, PyObject *kwds, int return_cas) {
+  static char *kwlist[] = { "key", "timeout", "callback", 0 };
+  PyObject *k, *timeout = 0, *callback = 0;
+  const char *key;
+  int nkey, usec;
 
-  if (!PyArg_ParseTuple(args, "Oi", &cb, &limit))
+  if (!kwds && PyTuple_GET_SIZE(args) == 1)
+    k = PyTuple_GET_ITEM(args, 0);
+  else if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO", kwlist, &k, &timeout, &callback))
     return 0;
 
-  if (limit < 1) {
-    PyErr_SetString(Failure, "limit must be an integer value greater than 0");
+  if (connection_key(k, &key, &nkey) || connection_usec((pylibcb_connection *) self, timeout, &usec))
     return 0;
-  } else if (limit > 16384) {
-    PyErr_SetString(Failure, "there is an arbitrary upper limit of 16384 simultaneous requests as that is enough for anyone");
+  pylibcb_instance *context = get_context(self);
+  if (!context)
     return 0;
-  }
 
-  set_context(cb);
-
-  if (context->async.count * 2 < limit)
-    async_size(&context->async, limit * 2);
-  context->async_limit = limit;
-
-  Py_RETURN_NONE;
+  return get_key(context, key, nkey, usec, 0, return_cas, callback);
 }
 
-static PyObject *get_async_count(PyObject *self, PyObject *args) {
-  PyObject *cb;
-
-  if (!PyArg_ParseTuple(args, "O", &cb))
-    return 0;
-
-  set_context(cb);
-  return PyInt_FromLong(context->async_count);
+PyObject *connection_get(PyObject *self, PyObject *args, PyObject *kwds) {
+  return connection_fetch(self, args, kwds, 0);
 }
 
-static PyObject *enable_async(PyObject *self, PyObject *args) {
-  PyObject *cb;
-
-  if (!PyArg_ParseTuple(args, "O", &cb))
-      return 0;
-  set_context(cb);
-
-  context->async_mode = 1;
-  context->async_count = 0;
-  if (context->async.count < context->async_limit * 2)
-    async_size(&context->async, context->async_limit * 2);
-
-  Py_RETURN_NONE;
+PyObject *connection_get_cas(PyObject *self, PyObject *args, PyObject *kwds) {
+  return connection_fetch(self, args, kwds, 1);
 }
 
-static PyObject *disable_async(PyObject *self, PyObject *args) {
-  PyObject *cb;
+PyObject *connection_set(PyObject *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = { "key", "value", "expiry", "cas", "format", "callback", "timeout", 0 };
+  PyObject *k, *value, *format = 0, *timeout = 0, *callback = 0;
+  unsigned long expiry = 0, cas = 0;
+  const char *key;
+  int nkey, usec, fmt = FMT_AUTO;
+
+  if (!kwds && PyTuple_GET_SIZE(args) == 2) {
+    k = PyTuple_GET_ITEM(args, 0);
+    value = PyTuple_GET_ITEM(args, 1);
+  } else if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|kkOOO", kwlist,
+					  &k, &value, &expiry, &cas, &format, &callback, &timeout))
+    return 0;
 
-  if (!PyArg_ParseTuple(args, "O", &cb))
+  if (format && format != Py_None) {
+    fmt = PyInt_AsLong(format);
+    if (fmt == -1 && PyErr_Occurred())
       return 0;
-  set_context(cb);
+  }
 
-  context->async_mode = 0;
+  if (connection_key(k, &key, &nkey) || connection_usec((pylibcb_connection *) self, timeout, &usec))
+    return 0;
+  pylibcb_instance *context = get_context(self);
+  if (!context)
+    return 0;
 
-  Py_RETURN_NONE;
+  return store_key(context, LIBCOUCHBASE_SET, key, nkey, value, expiry, cas, fmt, callback, usec);
 }
 
-static PyObject *set(PyObject *self, PyObject *args) {
-  PyObject *cb;
-  void *key, *val;
-  int nkey, nval;
-  unsigned long _expiry = 0;
-  unsigned long cas = 0;
+PyObject *connection_remove(PyObject *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = { "key", "callback", "timeout", 0 };
+  PyObject *k, *timeout = 0, *callback = 0;
+  const char *key;
+  int nkey, usec;
 
-  if (!PyArg_ParseTuple(args, "Os#s#|kk", &cb, &key, &nkey, &val, &nval, &_expiry, &cas))
+  if (!kwds && PyTuple_GET_SIZE(args) == 1)
+    k = PyTuple_GET_ITEM(args, 0);
+  else if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO", kwlist, &k, &callback, &timeout))
     return 0;
-  set_context(cb);
-
-  ASYNC_GUARD();
 
-  time_t expiry = _expiry;
-  int *ticket = new_ticket();
-  if (!ticket)
+  if (connection_key(k, &key, &nkey) || connection_usec((pylibcb_connection *) self, timeout, &usec))
     return 0;
-
-  libcouchbase_store_by_key(context->cb, hand_out_ticket(ticket), LIBCOUCHBASE_SET, 0, 0, 
-			    key, nkey, val, nval, 0, expiry, cas);
-  ASYNC_EXIT(ticket);
-
-  libcouchbase_wait(context->cb);
-  INTERNAL_EXCEPTION_HANDLER(return 0);
-
-  if (context->exception)
+  pylibcb_instance *context = get_context(self);
+  if (!context)
     return 0;
 
-  Py_RETURN_NONE;
+  return remove_key(context, key, nkey, 0, callback, usec);
 }
 
-static PyObject *_remove(PyObject *self, PyObject *args) {
-  PyObject *cb;
-  void *key;
-  int nkey;
-  unsigned long cas = 0;
-
-  if (!PyArg_ParseTuple(args, "Os#|k", &cb, &key, &nkey, &cas))
-    return 0;
-  set_context(cb);
-
-  ASYNC_GUARD();
-
-  int *ticket = new_ticket();
-  if (!ticket)
-    return 0;
-
-  libcouchbase_remove_by_key(context->cb, hand_out_ticket(ticket), 0, 0, key, nkey, cas);
-  ASYNC_EXIT(ticket);
+static PyMethodDef connection_methods[] = {
+  { "get", (PyCFunction) connection_get, METH_VARARGS | METH_KEYWORDS,
+    "get(key, timeout=0, callback=None)\n\n"
+    "Get a value by key, None if it does not exist. The timeout is in milliseconds; "
+    "the callback (async mode only) is invoked with (ticket, result) as soon as the response arrives" },
+  { "get_cas", (PyCFunction) connection_get_cas, METH_VARARGS | METH_KEYWORDS,
+    "get_cas(key, timeout=0, callback=None)\n\n"
+    "Get a (value, cas) tuple by key (see get)" },
+  { "set", (PyCFunction) connection_set, METH_VARARGS | METH_KEYWORDS,
+    "set(key, value, expiry=0, cas=0, format=None, callback=None, timeout=0)\n\n"
+    "Set a value by key. format is FMT_JSON, FMT_PICKLE, FMT_BYTES, FMT_UTF8 or a registered "
+    "custom format, picked from the value type by default (see get for callback and timeout)" },
+  { "remove", (PyCFunction) connection_remove, METH_VARARGS | METH_KEYWORDS,
+    "remove(key, callback=None, timeout=0)\n\n"
+    "Remove a value by key (see get for callback and timeout)" },
+  { 0, 0, 0, 0 }
+};
 
-  libcouchbase_wait(context->cb);
-  INTERNAL_EXCEPTION_HANDLER(return 0);
+static PyMemberDef connection_members[] = {
+  { "timeout", T_UINT, offsetof(pylibcb_connection, timeout), 0,
+    "default deadline in usecs, 0 for none" },
+  { 0 }
+};
 
-  if (context->exception)
-    return 0;
+static PyGetSetDef connection_getset[] = {
+  { "instance", connection_instance, 0,
+    "the connection itself, accepted wherever a pylibcb instance is", 0 },
+  { 0 }
+};
 
-  Py_RETURN_NONE;
-}
+static PyTypeObject ConnectionType = {
+  PyObject_HEAD_INIT(0)
+  0,
+  "_pylibcb.Connection",
+  sizeof(pylibcb_connection),
+  0,
+  connection_dealloc,
+};
 
-static PyObject *get(PyObject *self, PyObject *args) {
+static PyObject *async_wait(PyObject *self, PyObject *args) {
   PyObject *cb;
-  const void * const key;
-  int _nkey;
   int usec = 0;
-  unsigned long _expiry = 0;
-  int return_cas = 0;
-  
-  if (!PyArg_ParseTuple(args, "Os#|iki", &cb, &key, &_nkey, &usec, &_expiry, &return_cas))
+
+  if (!PyArg_ParseTuple(args, "Oi", &cb, &usec))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
     return 0;
-  set_context(cb);
 
-  ASYNC_GUARD();
+  if (!context->async_mode) {
+    PyErr_SetString(Failure, "async mode is not enabled");
+    return 0;
+  }
 
-  libcouchbase_size_t nkey = _nkey;
-  time_t expiry = _expiry;
-  int *ticket = new_ticket();
-  if (!ticket)
+  if (instance_reentered(context))
     return 0;
 
-  if (usec && !context->async_mode)
-    if (!create_timeout(usec, hand_out_ticket(ticket))) {
+  int *ticket = 0;
+  if (usec) {
+    ticket = new_ticket(context);
+    if (!ticket)
+      return 0;
+
+    if (!create_timeout(context, usec, hand_out_ticket(ticket))) {
       rip_ticket(ticket);
       return 0;
     }
+    hand_out_ticket(ticket);
+  }
 
-  libcouchbase_mget_by_key(context->cb, hand_out_ticket(ticket), 0, 0, 1, &key, &nkey, _expiry ? &expiry : 0);
-  ASYNC_EXIT(ticket);
+  while (!wait_expired(ticket) && context->async_count && !context->internal_exception)
+    instance_wait(context);
+
+  if (ticket) {
+    cancel_timeout(ticket);
+    rip_ticket(ticket);
+  }
 
-  while (!context->timed_out && !context->succeeded && !context->exception && !context->internal_exception)
-    libcouchbase_wait(context->cb);
   INTERNAL_EXCEPTION_HANDLER(return 0);
 
-  if (context->exception)
-    return 0;
-  
-  if (context->timed_out) {
-    PyErr_SetString(Timeout, "timeout in get");
+  if (raise_callback_error(context))
     return 0;
-  }
 
-  if (!context->succeeded) {
-    PyErr_SetString(Failure, "no timeout.. AND no success?");
+  PyObject *r = get_async_results(context, -1);
+  if (!r) {
+    PyErr_SetString(Failure, "get_async_results");
     return 0;
   }
 
-  if (context->result == LIBCOUCHBASE_KEY_ENOENT)
-    Py_RETURN_NONE;
-
-  if (return_cas)
-    return Py_BuildValue("Ok", context->returned_value, (unsigned long) context->returned_cas);
-  return context->returned_value;
+  /* the batch is over unless some requests are still in flight */
+  arena_reset(&context->arena);
+  return r;
 }
 
-static PyObject *async_wait(PyObject *self, PyObject *args) {
+static PyObject *async_poll(PyObject *self, PyObject *args) {
   PyObject *cb;
+  int limit = 0;
   int usec = 0;
+  int *ticket = 0;
 
-  if (!PyArg_ParseTuple(args, "Oi", &cb, &usec))
+  if (!PyArg_ParseTuple(args, "O|ii", &cb, &limit, &usec))
+    return 0;
+  pylibcb_instance *context = get_context(cb);
+  if (!context)
     return 0;
-  set_context(cb);
 
   if (!context->async_mode) {
     PyErr_SetString(Failure, "async mode is not enabled");
     return 0;
   }
 
-  if (usec) {
-    int *ticket = new_ticket();
-    if (!ticket)
-      return 0;
+  if (instance_reentered(context))
+    return 0;
+
+  /* run the event loop only until some result is available */
+  if (!context->async.count && context->async_count) {
+    if (usec) {
+      ticket = new_ticket(context);
+      if (!ticket)
+	return 0;
+
+      if (!create_timeout(context, usec, hand_out_ticket(ticket))) {
+	rip_ticket(ticket);
+	return 0;
+      }
+      hand_out_ticket(ticket);
+    }
 
-    if (!create_timeout(usec, hand_out_ticket(ticket))) {
+    while (!context->async.count && !wait_expired(ticket) && context->async_count
+	   && !context->internal_exception && !context->callback_error[0])
+      instance_loop_once(context);
+
+    if (ticket) {
+      cancel_timeout(ticket);
       rip_ticket(ticket);
-      return 0;
     }
   }
 
-  while (!context->timed_out && context->async_count && !context->internal_exception)
-    libcouchbase_wait(context->cb);
-
   INTERNAL_EXCEPTION_HANDLER(return 0);
 
-  PyObject *r = get_async_results();
-  if (!r) {
-    PyErr_SetString(Failure, "get_async_results");
+  if (raise_callback_error(context))
     return 0;
-  } return r;
+
+  return get_async_results(context, limit > 0 ? limit : -1);
 }
 
 static PyMethodDef PylibcbMethods[] = {
   { "open", open, METH_VARARGS,
     "Open connection to couchbase server" },
   { "get", get, METH_VARARGS,
-    "Get a value by key. Optionally specify timeout in usecs" },
+    "Get a value by key. Optionally specify a deadline in usecs" },
+  { "get_multi", get_multi, METH_VARARGS,
+    "Get values for a list of keys with a single request. Returns a dict. Optionally specify a deadline in usecs" },
   { "set", set, METH_VARARGS,
-    "Set a value by key" },
+    "Set a value by key. Optionally specify a deadline in usecs" },
+  { "add", add, METH_VARARGS,
+    "Store a value only if the key does not exist yet. Optionally specify a deadline in usecs" },
+  { "replace", replace, METH_VARARGS,
+    "Store a value only if the key exists. Optionally specify a deadline in usecs" },
+  { "append", append, METH_VARARGS,
+    "Append a string to an existing value. Optionally specify a deadline in usecs" },
+  { "prepend", prepend, METH_VARARGS,
+    "Prepend a string to an existing value. Optionally specify a deadline in usecs" },
   { "remove", _remove, METH_VARARGS,
-    "Remove a value by key" },
+    "Remove a value by key. Optionally specify a deadline in usecs" },
+  { "set_multi", set_multi, METH_VARARGS,
+    "Set values from a dict of key -> value with pipelined requests. Returns a dict of per key results. Optionally specify a deadline in usecs" },
+  { "add_multi", add_multi, METH_VARARGS,
+    "Add values from a dict of key -> value with pipelined requests. Returns a dict of per key results. Optionally specify a deadline in usecs" },
+  { "replace_multi", replace_multi, METH_VARARGS,
+    "Replace values from a dict of key -> value with pipelined requests. Returns a dict of per key results. Optionally specify a deadline in usecs" },
+  { "append_multi", append_multi, METH_VARARGS,
+    "Append strings from a dict of key -> string with pipelined requests. Returns a dict of per key results. Optionally specify a deadline in usecs" },
+  { "prepend_multi", prepend_multi, METH_VARARGS,
+    "Prepend strings from a dict of key -> string with pipelined requests. Returns a dict of per key results. Optionally specify a deadline in usecs" },
+  { "remove_multi", remove_multi, METH_VARARGS,
+    "Remove a list of keys with pipelined requests. Returns a dict of per key results. Optionally specify a deadline in usecs" },
+  { "arithmetic", arithmetic, METH_VARARGS,
+    "Add a signed delta to a counter, optionally creating it with an initial value. Returns the new value" },
+  { "arithmetic_multi", arithmetic_multi, METH_VARARGS,
+    "Apply a dict of key -> delta with pipelined requests. Returns a dict of per key results. Optionally specify a deadline in usecs" },
+  { "load_file", load_file, METH_VARARGS,
+    "Store every record of a memory mapped key<TAB>value ('tsv') or json lines ('jsonl') file with pipelined requests. Returns a summary with counts, failed keys and throughput" },
+  { "export_keys", export_keys, METH_VARARGS,
+    "Fetch the keys of a file (one per line) or iterable with pipelined requests, writing the values to a file and missing or failed keys to an optional side file. Returns a summary with counts, failed keys and throughput" },
   { "get_async_limit", get_async_limit, METH_VARARGS,
     "Get the limit for the number of requests allowed before one is required to complete" },
   { "set_async_limit", set_async_limit, METH_VARARGS,
     "Set the limit for the number of requests allowed before one is required to complete" },
+  { "set_retry_policy", set_retry_policy, METH_VARARGS,
+    "Retry transient failures up to attempts times with exponential backoff (usecs) within an overall deadline (usecs)" },
+  { "set_adaptive_window", set_adaptive_window, METH_VARARGS,
+    "Let the async limit adapt between min and max to latency, timeouts and temporary failures" },
   { "get_async_count", get_async_count, METH_VARARGS,
     "Get the number of incomplete asynchronous requests waiting" },
   { "enable_async", enable_async, METH_VARARGS,
     "Enable asynchronous behavior" },
   { "disable_async", disable_async, METH_VARARGS,
     "Disable asynchronous behavior" },
+  { "set_transcoding", set_transcoding, METH_VARARGS,
+    "Enable or disable encoding values by format and decoding them by item flags" },
+  { "set_compression", set_compression, METH_VARARGS,
+    "Compress stored values of at least threshold bytes with the given codec, 0 disables" },
+  { "enable_near_cache", enable_near_cache, METH_VARARGS,
+    "Cache values read through the instance, bounded by entries and bytes, for ttl microseconds" },
+  { "disable_near_cache", disable_near_cache, METH_VARARGS,
+    "Drop the near cache and stop caching" },
+  { "set_get_coalescing", set_get_coalescing, METH_VARARGS,
+    "Let async gets of a key with a get in flight wait for its response (off by default)" },
+  { "enable_trace", enable_trace, METH_VARARGS,
+    "Record single-key operations slower than a threshold in microseconds into a ring of entries" },
+  { "disable_trace", disable_trace, METH_VARARGS,
+    "Stop tracing and drop the recorded entries" },
+  { "drain_trace", drain_trace, METH_VARARGS,
+    "Return and forget the recorded slow operations, oldest first; with peek set they are kept" },
+  { "discard_trace", discard_trace, METH_VARARGS,
+    "Forget the oldest recorded slow operations" },
+  { "register_format", register_format, METH_VARARGS,
+    "Register an encoder and decoder for a custom format number" },
+  { "enable_buffer_values", enable_buffer_values, METH_VARARGS,
+    "Return values as undecoded Value objects supporting the buffer protocol" },
+  { "disable_buffer_values", disable_buffer_values, METH_VARARGS,
+    "Return decoded values" },
+  { "get_copy_avoided_bytes", get_copy_avoided_bytes, METH_VARARGS,
+    "Get the number of value bytes delivered without an intermediate copy" },
+  { "stats", stats, METH_VARARGS,
+    "Get latency percentiles in usecs per op type, operation counters and op arena usage. Optionally reset them" },
   { "async_wait", async_wait, METH_VARARGS,
     "Execute eventloop for a given number of microseconds" },
+  { "loop_fd", loop_fd, METH_VARARGS,
+    "Get the file descriptor an external event loop should watch for readability" },
+  { "loop_timeout", loop_timeout, METH_VARARGS,
+    "Get the number of seconds until the next timer expires, or None" },
+  { "loop_step", loop_step, METH_VARARGS,
+    "Dispatch ready sockets and expired timers without blocking" },
+  { "async_poll", async_poll, METH_VARARGS,
+    "Get at most a given number of async results, running the eventloop until at least one is available or the timeout in microseconds expires" },
   { 0, 0, 0, 0 }
 };
 
 PyMODINIT_FUNC init_pylibcb() {
   PyObject *m;
 
+  PyEval_InitThreads();
+
   m = Py_InitModule("_pylibcb", PylibcbMethods);
   if (!m)
     return;
@@ -913,27 +6050,88 @@ PyMODINIT_FUNC init_pylibcb() {
   struct exception_init {
     char *name;
     PyObject **exception;
+    PyObject **base;
   } exceptions[] = {
     { "Timeout", &Timeout },
     { "OutOfMemory", &OutOfMemory },
     { "ConnectionFailure", &ConnectionFailure },
     { "Failure", &Failure },
     { "KeyExists", &KeyExists },
+    { "NotFound", &NotFound, &Failure },
     { "AsyncLimit", &AsyncLimit },
     { 0, 0 }
   };
 
+  struct format_init {
+    char *name;
+    int format;
+  } formats[] = {
+    { "FMT_JSON", FMT_JSON },
+    { "FMT_PICKLE", FMT_PICKLE },
+    { "FMT_BYTES", FMT_BYTES },
+    { "FMT_UTF8", FMT_UTF8 },
+    { "FMT_AUTO", FMT_AUTO },
+    { "FMT_MASK", FMT_MASK },
+    { "FMT_CUSTOM", FMT_CUSTOM },
+    { "COMPRESS_ZLIB", COMPRESS_ZLIB },
+    { "COMPRESS_LZ4", COMPRESS_LZ4 },
+    { 0, 0 }
+  };
+
   int i = 0;
+  while (formats[i].name) {
+    PyModule_AddIntConstant(m, formats[i].name, formats[i].format);
+    ++i;
+  }
+
+  ValueType.tp_as_sequence = &value_as_sequence;
+  ValueType.tp_as_buffer = &value_as_buffer;
+  ValueType.tp_str = value_str;
+  ValueType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER;
+  ValueType.tp_doc = "Received value exposing its bytes through the buffer protocol";
+  ValueType.tp_members = value_members;
+  ValueType.tp_methods = value_methods;
+  if (PyType_Ready(&ValueType) < 0)
+    return;
+  Py_INCREF(&ValueType);
+  PyModule_AddObject(m, "Value", (PyObject *) &ValueType);
+
+  ConnectionType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+  ConnectionType.tp_doc = "Connection to a Couchbase bucket, usable wherever a pylibcb instance is. "
+    "Connection(host='localhost', user='', password='', bucket='default', timeout=0, io_thread=0)";
+  ConnectionType.tp_methods = connection_methods;
+  ConnectionType.tp_members = connection_members;
+  ConnectionType.tp_getset = connection_getset;
+  ConnectionType.tp_init = connection_init;
+  ConnectionType.tp_new = PyType_GenericNew;
+  if (PyType_Ready(&ConnectionType) < 0)
+    return;
+  Py_INCREF(&ConnectionType);
+  PyModule_AddObject(m, "Connection", (PyObject *) &ConnectionType);
+
+  PyObject *json = PyImport_ImportModule("json");
+  PyObject *pickle = PyImport_ImportModule("cPickle");
+  if (!json || !pickle)
+    return;
+
+  json_dumps = PyObject_GetAttrString(json, "dumps");
+  json_loads = PyObject_GetAttrString(json, "loads");
+  pickle_dumps = PyObject_GetAttrString(pickle, "dumps");
+  pickle_loads = PyObject_GetAttrString(pickle, "loads");
+  Py_DECREF(json);
+  Py_DECREF(pickle);
+  if (!json_dumps || !json_loads || !pickle_dumps || !pickle_loads)
+    return;
+
+  i = 0;
   while (exceptions[i].name) {
     char name[256];
     sprintf(name, "_pylibcb.%s", exceptions[i].name);
-    *exceptions[i].exception = PyErr_NewException(name, 0, 0);
+    *exceptions[i].exception = PyErr_NewException(name, exceptions[i].base ? *exceptions[i].base : 0, 0);
     Py_INCREF(*exceptions[i].exception);
     PyModule_AddObject(m, exceptions[i].name, *exceptions[i].exception);
     ++i;
   }
-
-  default_exception = Failure;
 }
 
 int main(int argc, char **argv) {  
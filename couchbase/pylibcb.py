@@ -1,101 +1,482 @@
+import json
+
 import _pylibcb
 
-from decorators import get_as_json, set_as_json
+from _pylibcb import FMT_JSON, FMT_PICKLE, FMT_BYTES, FMT_UTF8
+from _pylibcb import COMPRESS_ZLIB, COMPRESS_LZ4
+
+
+def _format(format):
+    return _pylibcb.FMT_AUTO if format is None else format
 
 
-class Client(object):
+class Client(_pylibcb.Connection):
 
-    """Couchbase client"""
+    """Couchbase client.
+
+    get, get_cas, set and remove are implemented by the native Connection
+    type; the client is also accepted wherever a pylibcb instance is."""
 
     def __init__(self, host='localhost', user='', password='',
-                 bucket='default', timeout=0):
+                 bucket='default', timeout=0, io_thread=False):
         """Open connection to Couchbase server.
 
         :param host: hostname of IP address
         :param user: administrative username (is SASL bucked is used)
         :param password: administrative password (is SASL bucked is used)
         :param bucket: bucket name
-        :param timeout: optional timeout in milliseconds"""
-        self.instance = _pylibcb.open(host, user, password, bucket)
-        self.timeout = int(timeout * 1000)
+        :param timeout: optional default deadline in milliseconds for every
+        operation; operations past their deadline raise (or, in async
+        mode, complete with) _pylibcb.Timeout
+        :param io_thread: run the connection on a native I/O thread so any
+        number of python threads can share the client; single key get,
+        store, remove and counter operations only (no async mode, batches
+        or retries)"""
+        _pylibcb.Connection.__init__(self, host, user, password, bucket,
+                                     timeout, int(io_thread))
+        _pylibcb.set_transcoding(self, 1)
 
-    @get_as_json
-    def get(self, key, timeout=0):
-        """Get a value by key.
+    def gat(self, key, expiry, timeout=0, callback=None):
+        """Get and touch.
 
         :param key: key to search for
-        :param timeout: optional timeout in milliseconds"""
+        :param expiry: new expiration time
+        :param timeout: optional timeout in milliseconds
+        :param callback: optional callable invoked with (ticket, result) as
+        soon as the response arrives (async mode only)"""
         timeout = int(timeout * 1000) or self.timeout
-        return _pylibcb.get(self.instance, key, timeout)
+        return _pylibcb.get(self, key, timeout, expiry, 0, callback)
 
-    @get_as_json
-    def gat(self, key, expiry, timeout=0):
-        """Get and touch.
+    def gat_cas(self, key, expiry, timeout=0, callback=None):
+        """GAT with CAS.
 
         :param key: key to search for
         :param expiry: new expiration time
+        :param timeout: optional timeout in milliseconds
+        :param callback: optional callable invoked with (ticket, result) as
+        soon as the response arrives (async mode only)"""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.get(self, key, timeout, expiry, 1, callback)
+
+    def get_multi(self, keys, timeout=0, expiry=0, cas=False):
+        """Get values for a list of keys in a single request.
+
+        Returns a dict of key -> value (or (value, cas) tuples if cas is
+        set). Missing keys map to None.
+
+        :param keys: list of keys to search for
+        :param timeout: optional timeout in milliseconds for the whole
+        batch; keys without a result by then map to a Timeout instance
+        :param expiry: optional new expiration time (get and touch)
+        :param cas: return (value, cas) tuples"""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.get_multi(self, keys, timeout, expiry,
+                                  int(cas))
+
+    def add(self, key, value, expiry=0, format=None, callback=None,
+            timeout=0):
+        """Store a value only if the key does not exist yet.
+
+        Raises KeyExists if it does. Takes the same arguments as set."""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.add(self, key, value, expiry, 0,
+                            _format(format), callback, timeout)
+
+    def replace(self, key, value, expiry=0, cas=0, format=None,
+                callback=None, timeout=0):
+        """Store a value only if the key exists.
+
+        Raises NotFound if it does not. Takes the same arguments as set."""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.replace(self, key, value, expiry, cas,
+                                _format(format), callback, timeout)
+
+    def append(self, key, value, cas=0, callback=None, timeout=0):
+        """Append a string to an existing value.
+
+        The bytes are sent as they are (unicode as UTF-8) and the item
+        keeps its flags, so only append to raw or UTF-8 values. Raises
+        NotFound if the key does not exist, and _pylibcb.Failure while
+        compression is enabled (see set_compression), since appending to
+        a compressed item would corrupt it.
+
+        :param key: document key
+        :param value: string to append
+        :param cas: CAS (Compare And Swap) value
+        :param callback: optional callable invoked with (ticket, result) as
+        soon as the response arrives (async mode only)
         :param timeout: optional timeout in milliseconds"""
         timeout = int(timeout * 1000) or self.timeout
-        return _pylibcb.get(self.instance, key, timeout, expiry)
+        return _pylibcb.append(self, key, value, 0, cas,
+                               FMT_BYTES, callback, timeout)
 
-    @get_as_json
-    def get_cas(self, key, timeout=0):
-        """GET with CAS.
+    def prepend(self, key, value, cas=0, callback=None, timeout=0):
+        """Prepend a string to an existing value (see append)."""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.prepend(self, key, value, 0, cas,
+                                FMT_BYTES, callback, timeout)
 
-        :param key: key to search for
+    def set_multi(self, values, expiry=0, cas=None, format=None, timeout=0):
+        """Set many values with pipelined requests.
+
+        Returns a dict of key -> True or the exception raised for that key
+        (e.g. KeyExists). Failures do not stop the batch; the async limit
+        bounds the number of requests in flight.
+
+        :param values: dict of document key -> document value
+        :param expiry: expiration time
+        :param cas: optional dict of document key -> CAS value
+        :param format: value format (see set)
+        :param timeout: optional timeout in milliseconds for the whole
+        batch; keys without a result by then map to a Timeout instance"""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.set_multi(self, values, expiry, cas,
+                                  _format(format), timeout)
+
+    def add_multi(self, values, expiry=0, format=None, timeout=0):
+        """Add many values with pipelined requests; keys that already
+        exist map to KeyExists (see set_multi)"""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.add_multi(self, values, expiry, None,
+                                  _format(format), timeout)
+
+    def replace_multi(self, values, expiry=0, cas=None, format=None,
+                      timeout=0):
+        """Replace many values with pipelined requests; missing keys map
+        to NotFound (see set_multi)"""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.replace_multi(self, values, expiry, cas,
+                                      _format(format), timeout)
+
+    def append_multi(self, values, timeout=0):
+        """Append strings from a dict of key -> string with pipelined
+        requests (see append and set_multi)"""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.append_multi(self, values, 0, None,
+                                     FMT_BYTES, timeout)
+
+    def prepend_multi(self, values, timeout=0):
+        """Prepend strings from a dict of key -> string with pipelined
+        requests (see append and set_multi)"""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.prepend_multi(self, values, 0, None,
+                                      FMT_BYTES, timeout)
+
+    def remove_multi(self, keys, timeout=0):
+        """Remove many values with pipelined requests.
+
+        Returns a dict of key -> True or the exception raised for that key.
+
+        :param keys: keys of documents to be removed
+        :param timeout: optional timeout in milliseconds for the whole
+        batch (see set_multi)"""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.remove_multi(self, keys, timeout)
+
+    def incr(self, key, delta=1, initial=None, expiry=0, callback=None,
+             timeout=0):
+        """Increment a counter on the server and return its new value.
+
+        Counters are stored as decimal strings and read back by get as
+        ints. The server never lets a counter go below zero.
+
+        :param key: counter key
+        :param delta: amount to add, may be negative
+        :param initial: value stored if the key does not exist; a missing
+        key raises Failure when None
+        :param expiry: expiration time, used when the counter is created
+        :param callback: optional callable invoked with (ticket, result) as
+        soon as the response arrives (async mode only)
         :param timeout: optional timeout in milliseconds"""
         timeout = int(timeout * 1000) or self.timeout
-        return _pylibcb.get(self.instance, key, timeout, 0, 1)
+        return _pylibcb.arithmetic(self, key, delta, initial or 0,
+                                   int(initial is not None), expiry,
+                                   callback, timeout)
 
-    @get_as_json
-    def gat_cas(self, key, expiry, timeout=0):
-        """GAT with CAS.
+    def decr(self, key, delta=1, initial=None, expiry=0, callback=None,
+             timeout=0):
+        """Decrement a counter on the server and return its new value.
 
-        :param key: key to search for
-        :param expiry: new expiration time
+        :param key: counter key
+        :param delta: amount to subtract
+        :param initial: value stored if the key does not exist (see incr)
+        :param expiry: expiration time, used when the counter is created
+        :param callback: optional callable invoked with (ticket, result) as
+        soon as the response arrives (async mode only)
         :param timeout: optional timeout in milliseconds"""
+        return self.incr(key, -delta, initial, expiry, callback, timeout)
+
+    def incr_multi(self, deltas, initial=None, expiry=0, timeout=0):
+        """Apply many counter deltas with pipelined requests.
+
+        Returns a dict of key -> new value or the exception raised for
+        that key.
+
+        :param deltas: dict of counter key -> delta (negative to decrement)
+        :param initial: value stored for keys that do not exist (see incr)
+        :param expiry: expiration time, used when a counter is created
+        :param timeout: optional timeout in milliseconds for the whole
+        batch (see set_multi)"""
         timeout = int(timeout * 1000) or self.timeout
-        return _pylibcb.get(self.instance, key, timeout, expiry, 1)
+        return _pylibcb.arithmetic_multi(self, deltas, initial or 0,
+                                         int(initial is not None), expiry,
+                                         timeout)
 
-    @set_as_json
-    def set(self, key, value, expiry=0, cas=0):
-        """Set a value by key.
+    def load_file(self, path, format='jsonl', expiry=0, window=0,
+                  max_failures=1000, key_field='_id'):
+        """Store every record of a file with pipelined requests.
 
-        :param key: document key
-        :param value: document value
+        The file is memory mapped and parsed in C, values are stored as
+        they appear in the file (not compressed) and no python object is
+        created per record. Needs sync mode.
+
+        Returns a dict with the number of records stored and failed,
+        failures (key -> exception, at most max_failures), malformed and
+        bad_lines (line numbers), bytes, seconds, per_second and
+        mb_per_second.
+
+        :param path: file name
+        :param format: 'jsonl', one json object per line stored as json
+        under the value of its key_field member, or 'tsv', key<TAB>value
+        lines stored as bytes
         :param expiry: expiration time
-        :param cas: CAS (Compare And Swap) value"""
-        return _pylibcb.set(self.instance, key, value, expiry, cas)
+        :param window: number of requests in flight, the async limit if 0
+        :param max_failures: number of failed keys and bad lines reported
+        :param key_field: member holding the key in 'jsonl' files"""
+        return _pylibcb.load_file(self, path, format, expiry,
+                                  window, max_failures, key_field)
+
+    def export_keys(self, keys, path, errors=None, window=0,
+                    max_failures=1000):
+        """Fetch many keys with pipelined requests and write the values
+        to a file, without a python object per value. Needs sync mode.
+
+        Each value is written as stored, after a
+        key<TAB>flags<TAB>cas<TAB>length line, and followed by a newline.
+
+        Returns a dict with the number of keys exported, missing and
+        failed, failures (key -> exception, at most max_failures), bytes,
+        seconds, per_second and mb_per_second.
+
+        :param keys: name of a file with one key per line, or an iterable
+        of keys
+        :param path: output file name
+        :param errors: optional file name for key<TAB>reason lines of keys
+        that were missing or failed
+        :param window: number of requests in flight, the async limit if 0
+        :param max_failures: number of failed keys reported"""
+        return _pylibcb.export_keys(self, keys, path, errors,
+                                    window, max_failures)
+
+    def register_format(self, format, encode, decode):
+        """Register a custom value format.
+
+        :param format: format number stored in the item flags, from
+        FMT_CUSTOM to FMT_MASK
+        :param encode: callable turning a value into a string
+        :param decode: callable turning a string back into a value"""
+        return _pylibcb.register_format(self, format, encode, decode)
+
+    def set_compression(self, threshold, codec=None):
+        """Compress values of at least threshold bytes before storing them.
+
+        Compression is recorded in the item flags, so values are
+        decompressed on get whatever the reader's own setting, provided
+        the reader was built with the codec (LZ4 is optional). A value is
+        stored uncompressed if compressing it does not make it smaller.
+
+        :param threshold: minimum encoded size in bytes, 0 to disable
+        :param codec: COMPRESS_LZ4 or COMPRESS_ZLIB; LZ4 if the extension
+        was built with it, zlib otherwise"""
+        if codec is None:
+            return _pylibcb.set_compression(self, threshold)
+        return _pylibcb.set_compression(self, threshold, codec)
+
+    def enable_near_cache(self, max_entries=10000, max_bytes=64 << 20,
+                          ttl=1000):
+        """Keep values read by get in an in-process cache.
+
+        Repeated gets of a cached key are answered without a server round
+        trip (get_cas returns the cached CAS). Writes through this client
+        drop the entry for their key; writes made by other clients are
+        only seen once the entry expires, so keep ttl short. gat always
+        goes to the server.
+
+        :param max_entries: maximum number of cached keys
+        :param max_bytes: maximum size of keys and values held
+        :param ttl: milliseconds a value is served from the cache"""
+        return _pylibcb.enable_near_cache(self, max_entries,
+                                          max_bytes, int(ttl * 1000))
+
+    def disable_near_cache(self):
+        """Drop the near cache and read every value from the server"""
+        return _pylibcb.disable_near_cache(self)
+
+    def enable_trace(self, threshold=10, entries=1024):
+        """Record single-key operations slower than threshold.
+
+        Each entry has the op type, the key (first 48 bytes, anything
+        but printable ASCII escaped as \\xNN) and its length, the value
+        size, whether it timed out and, in microseconds after submission,
+        when the request was flushed by the event loop (None if not
+        known), when libcouchbase called back (None for timeouts) and
+        when the result reached python. Only the last entries are kept.
+
+        :param threshold: milliseconds from submission to delivery
+        :param entries: size of the ring of recorded operations"""
+        return _pylibcb.enable_trace(self, int(threshold * 1000), entries)
 
-    def remove(self, key):
-        """Remove a value by key
+    def disable_trace(self):
+        """Stop tracing and drop recorded operations"""
+        return _pylibcb.disable_trace(self)
 
-        :param key: key of document to be removed"""
-        return _pylibcb.remove(self.instance, key)
+    def drain_trace(self):
+        """Get and forget the recorded slow operations, oldest first"""
+        return _pylibcb.drain_trace(self)
+
+    def dump_trace(self, f):
+        """Drain the recorded slow operations into a file as JSON lines.
+
+        :param f: file object open for writing
+        :return: number of entries written"""
+        # entries are only forgotten once they were written
+        entries = _pylibcb.drain_trace(self, 1)
+        f.write(''.join(json.dumps(entry, sort_keys=True) + '\n'
+                        for entry in entries))
+        _pylibcb.discard_trace(self, len(entries))
+        return len(entries)
+
+    def enable_buffer_values(self):
+        """Return values as undecoded _pylibcb.Value objects.
+
+        A Value holds the received bytes and exposes them through the
+        buffer protocol (memoryview, buffer, str), so values passed on to
+        sockets, files or parsers are never copied again. Call decode() on
+        it to get the value a regular get would return."""
+        return _pylibcb.enable_buffer_values(self)
+
+    def disable_buffer_values(self):
+        """Return decoded values"""
+        return _pylibcb.disable_buffer_values(self)
+
+    def get_copy_avoided_bytes(self):
+        """Get the number of value bytes delivered as Value objects without
+        the intermediate copy made for decoding"""
+        return _pylibcb.get_copy_avoided_bytes(self)
+
+    def stats(self, percentiles=(50, 99, 99.9), reset=False):
+        """Get measurements kept by the connection.
+
+        Returns a dict with 'latency' (per op type count, min, max, mean
+        and the requested percentiles, in microseconds from submission to
+        completion of single-key ops), 'batch_latency' (the same for
+        multi-key and bulk calls, one sample per call), 'ops' (per op
+        type, one per key), bytes_sent, bytes_received, misses, timeouts (expired
+        deadlines), 'errors' (libcouchbase error name -> count), retries
+        and retries_exhausted (see set_retry_policy),
+        'compression' (values compressed and skipped, bytes in and out,
+        ratio and time spent either way), 'near_cache' (hits, misses,
+        evictions, expirations, invalidations, entries and bytes),
+        'coalescing' (gets sent others could join, gets coalesced into
+        them, the coalesced fraction, keys in flight and whether it is
+        enabled),
+        'window' (async limit, adaptive window bounds, adjustment counts
+        and a history of (time, from, to, reason) tuples), 'trace' (see
+        enable_trace; None when off) and 'arena'
+        (per-operation records: chunks, records, in use, high water,
+        bytes, resets and chunks trimmed). The older slab counters
+        ('ticket_slabs', 'tickets', 'free_tickets' and their 'event_'
+        counterparts) are still reported, as chunks, records carved since
+        the last reset and records on the free list.
+
+        :param percentiles: percentiles reported as 'p50', 'p99' etc.
+        :param reset: clear latencies and counters after reading them"""
+        return _pylibcb.stats(self, percentiles, int(reset))
 
     def get_async_limit(self):
         """Get the limit for the number of requests allowed before one is
         required to complete"""
-        return _pylibcb.get_async_limit(self.instance)
+        return _pylibcb.get_async_limit(self)
 
     def set_async_limit(self, limit):
         """Set the limit for the number of requests allowed before one is
         required to complete"""
-        return _pylibcb.set_async_limit(self.instance, limit)
+        return _pylibcb.set_async_limit(self, limit)
+
+    def set_retry_policy(self, attempts=3, backoff=1, max_backoff=100,
+                         deadline=1000):
+        """Retry transient failures (ETMPFAIL, EBUSY, NOT_MY_VBUCKET)
+        without returning to python.
+
+        A failed request is sent again after a backoff that doubles with
+        every attempt, jittered between half and all of it, so callers
+        only see the final result or error. stats() counts retries and
+        requests that ran out of attempts.
+
+        :param attempts: maximum number of attempts, 1 disables retries
+        :param backoff: milliseconds before the first retry
+        :param max_backoff: upper bound for the backoff in milliseconds
+        :param deadline: milliseconds after the first attempt past which
+        no retry is started"""
+        return _pylibcb.set_retry_policy(self, attempts,
+                                         int(backoff * 1000),
+                                         int(max_backoff * 1000),
+                                         int(deadline * 1000))
+
+    def enable_adaptive_window(self, min_limit=4, max_limit=16384):
+        """Adapt the async limit to the connection instead of fixing it.
+
+        The limit grows by one request per window of completions while
+        latency is stable and halves on timeouts, temporary failures
+        (ETMPFAIL, EBUSY) or when p99 latency rises well above its recent
+        baseline. Requests beyond the limit wait for completions instead
+        of raising AsyncLimit. stats()['window'] shows the current limit
+        and recent adjustments.
+
+        :param min_limit: smallest window
+        :param max_limit: largest window"""
+        return _pylibcb.set_adaptive_window(self, 1, min_limit,
+                                            max_limit)
+
+    def disable_adaptive_window(self):
+        """Keep the async limit where the adaptive window left it"""
+        return _pylibcb.set_adaptive_window(self, 0)
 
     def get_async_count(self):
         """Get the number of incomplete asynchronous requests waiting"""
-        return _pylibcb.get_async_count(self.instance)
+        return _pylibcb.get_async_count(self)
+
+    def set_get_coalescing(self, enabled=True):
+        """Let an async get wait for the response to a get of the same
+        key already in flight instead of sending its own request.
+
+        Off by default: a joined get sees the value as of the earlier
+        request, not its own. Each waiting get still gets its own decoded
+        value, and a write of the key submitted in between makes later
+        gets go to the server again. gat and get_multi are never
+        coalesced.
+
+        :param enabled: False sends every get to the server"""
+        return _pylibcb.set_get_coalescing(self, int(enabled))
 
     def enable_async(self):
         """Enable asynchronous behavior"""
-        return _pylibcb.enable_async(self.instance)
+        return _pylibcb.enable_async(self)
 
     def disable_async(self):
         """Disable asynchronous behavior"""
-        return _pylibcb.disable_async(self.instance)
+        return _pylibcb.disable_async(self)
 
     def async_wait(self, timeout=0):
         """Execute eventloop for a given number of milliseconds"""
         timeout = int(timeout * 1000) or self.timeout
-        return _pylibcb.async_wait(self.instance, timeout)
+        return _pylibcb.async_wait(self, timeout)
+
+    def async_poll(self, limit=0, timeout=0):
+        """Get at most limit (ticket, result) pairs, running the eventloop
+        only until at least one result is available.
+
+        :param limit: maximum number of results returned, 0 for all
+        :param timeout: optional timeout in milliseconds"""
+        timeout = int(timeout * 1000) or self.timeout
+        return _pylibcb.async_poll(self, limit, timeout)
@@ -1,7 +1,18 @@
+import os
 from distutils.core import setup, Extension
 
+libraries = ['event', 'couchbase', 'z', 'pthread']
+macros = []
+
+# lz4 is optional, values are compressed with zlib without it
+if [d for d in ('/usr/include', '/usr/local/include')
+        if os.path.exists(os.path.join(d, 'lz4.h'))]:
+    libraries.append('lz4')
+    macros.append(('HAVE_LZ4', None))
+
 pylibcb = Extension('_pylibcb',
-                    libraries=['event', 'couchbase'],
+                    libraries=libraries,
+                    define_macros=macros,
                     sources=['couchbase/pylibcb.c'])
 
 setup(